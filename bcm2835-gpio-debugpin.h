@@ -37,26 +37,44 @@
 #include <linux/spi/spi.h>
 */
 
-static u32* gpio=0;
-static inline void alloc_gpio(void) {
-	gpio = ioremap(GPIO_BASE, SZ_16K);
+#include <linux/jump_label.h>
+
+static u32 *gpio;
+
+/* map the GPIO block once - called from probe, not from the hot path */
+static inline int alloc_gpio(void)
+{
+	if (!gpio)
+		gpio = ioremap(GPIO_BASE, SZ_16K);
+	return gpio ? 0 : -ENOMEM;
 }
 
-/* a macro to create set_high/low for timing debug purposes */
+/*
+ * a macro to create set_high/low for timing debug purposes
+ *
+ * the pins are gated by static keys, so with no pin configured the
+ * calls in the hot path are a single nop - debug_init_pin##number()
+ * has to get called from probe to map the GPIOs and patch in the
+ * code that toggles the pin
+ */
 #define _DEFINE_DEBUG_PIN_(number)					\
 	static int debugpin##number = 0;				\
-	module_param(debugpin##number,int,0);				\
-	MODULE_PARM_DESC(debugpin##number,"the pin that we should toggle"); \
+	module_param(debugpin##number, int, 0);				\
+	MODULE_PARM_DESC(debugpin##number, "the pin that we should toggle"); \
+	static struct static_key debugpin_key##number =			\
+		STATIC_KEY_INIT_FALSE;					\
+	static inline void __maybe_unused debug_init_pin##number(void) { \
+		if ((debugpin##number > 0) &&				\
+		    !static_key_enabled(&debugpin_key##number) &&	\
+		    !alloc_gpio())					\
+			static_key_slow_inc(&debugpin_key##number);	\
+	}								\
 	static inline void __maybe_unused debug_set_low##number(void) {	\
-		if (debugpin##number>0) {				\
-			if (!gpio) alloc_gpio();			\
-			gpio[0x28/4]=1<<debugpin##number;		\
-		}							\
+		if (static_key_false(&debugpin_key##number))		\
+			gpio[0x28/4] = 1 << debugpin##number;		\
 	}								\
 	static inline void __maybe_unused debug_set_high##number(void) { \
-		if (debugpin##number>0) {				\
-			if (!gpio) alloc_gpio();			\
-			gpio[0x1C/4]=1<<debugpin##number;		\
-		}							\
+		if (static_key_false(&debugpin_key##number))		\
+			gpio[0x1C/4] = 1 << debugpin##number;		\
 	}
 #define DEFINE_DEBUG_PIN(number) _DEFINE_DEBUG_PIN_(number)
@@ -0,0 +1,2062 @@
+/*
+ * shared core of the Broadcom BCM2835 and BCM2708 SPI drivers
+ *
+ * both drivers drive the same IP, so register definitions, the FIFO
+ * engines, interrupt handling and the message state machine live here
+ * as static (inline) code that gets specialised at compile time for the
+ * driver including it. The driver only plugs in its differences:
+ *
+ * - it has to define bcm2835_spi_prepare_transfer() to compute the
+ *   CS and CLK register values of a transfer
+ * - if it defines BCM2835_SPI_DMA before including this file, it also
+ *   has to provide bcm2835_spi_start_dma() and bcm2835_spi_stop_dma()
+ * - it may define BCM2835_SPI_TIMEOUT_MS before including this file -
+ *   the time a single piece of a transfer may take on the wire
+ *
+ * Copyright (C) 2012 Chris Boot
+ * Copyright (C) 2013 Stephen Warren
+ * Copyright (C) 2015 Martin Sperl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * requires the following includes - the debug pins have to be
+ * defined by the including driver as well
+#include <linux/clk.h>
+#include <linux/completion.h>
+#include <linux/crc-itu-t.h>
+#include <linux/crc32.h>
+#include <linux/crc7.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/interrupt.h>
+#include <linux/io.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/of.h>
+#include <linux/pm_runtime.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/spi/spi.h>
+#include <linux/spi/spi-bcm2835.h>
+#include <linux/wait.h>
+#include <asm/unaligned.h>
+*/
+
+/* SPI register offsets */
+#define BCM2835_SPI_CS			0x00
+#define BCM2835_SPI_FIFO		0x04
+#define BCM2835_SPI_CLK			0x08
+#define BCM2835_SPI_DLEN		0x0c
+#define BCM2835_SPI_LTOH		0x10
+#define BCM2835_SPI_DC			0x14
+
+/* Bitfields in CS */
+#define BCM2835_SPI_CS_LEN_LONG		0x02000000
+#define BCM2835_SPI_CS_DMA_LEN		0x01000000
+#define BCM2835_SPI_CS_CSPOL2		0x00800000
+#define BCM2835_SPI_CS_CSPOL1		0x00400000
+#define BCM2835_SPI_CS_CSPOL0		0x00200000
+#define BCM2835_SPI_CS_RXF		0x00100000
+#define BCM2835_SPI_CS_RXR		0x00080000
+#define BCM2835_SPI_CS_TXD		0x00040000
+#define BCM2835_SPI_CS_RXD		0x00020000
+#define BCM2835_SPI_CS_DONE		0x00010000
+#define BCM2835_SPI_CS_LEN		0x00002000
+#define BCM2835_SPI_CS_REN		0x00001000
+#define BCM2835_SPI_CS_ADCS		0x00000800
+#define BCM2835_SPI_CS_INTR		0x00000400
+#define BCM2835_SPI_CS_INTD		0x00000200
+#define BCM2835_SPI_CS_DMAEN		0x00000100
+#define BCM2835_SPI_CS_TA		0x00000080
+#define BCM2835_SPI_CS_CSPOL		0x00000040
+#define BCM2835_SPI_CS_CLEAR_RX		0x00000020
+#define BCM2835_SPI_CS_CLEAR_TX		0x00000010
+#define BCM2835_SPI_CS_CPOL		0x00000008
+#define BCM2835_SPI_CS_CPHA		0x00000004
+#define BCM2835_SPI_CS_CS_10		0x00000002
+#define BCM2835_SPI_CS_CS_01		0x00000001
+
+/* the D/C bit of a LoSSI word - set for data, clear for commands */
+#define BCM2835_SPI_LOSSI_DATA		0x100
+
+#ifndef BCM2835_SPI_TRACE
+/* only spi-bcm2835 defines the tracepoints */
+static inline bool trace_spi_bcm2835_transfer_enabled(void)
+{
+	return false;
+}
+
+static inline void trace_spi_bcm2835_transfer(struct spi_message *mesg,
+		struct spi_transfer *tfr, ktime_t start, ktime_t done)
+{
+}
+#endif
+
+#ifndef BCM2835_SPI_TIMEOUT_MS
+#define BCM2835_SPI_TIMEOUT_MS	30000
+#endif
+
+/* bcm2835_spi_wait_pattern busy polls this many bytes before it starts
+ * sleeping in between (up to BCM2835_SPI_WAIT_SLEEP_MAX_US), and gives
+ * up after BCM2835_SPI_WAIT_TIMEOUT_US - long enough for the busy time
+ * of SD card writes - unless the client asks for a different timeout
+ */
+#define BCM2835_SPI_WAIT_SPIN_BYTES	16
+#define BCM2835_SPI_WAIT_SLEEP_MAX_US	1000
+#define BCM2835_SPI_WAIT_TIMEOUT_US	250000
+
+/* how long a transfer waits for the end of a rate change of the core
+ * clock before it reads the rate itself - the clk framework sends
+ * neither POST nor ABORT if the rate ends up unchanged
+ */
+#define BCM2835_SPI_CLK_CHANGE_MS	10
+
+/* the time we will poll the device if calibration is not possible */
+#define BCM2835_SPI_POLLTIME_US 20
+
+/* the minimum length of a transfer that we will run via DMA
+ * if calibration is not possible
+ */
+#define BCM2835_SPI_DMA_MIN_LENGTH	96
+/* DLEN is only 16 bit wide - so we need to split longer transfers
+ * into chunks, which we keep a multiple of 4 bytes, as the DMA
+ * always moves whole 32 bit words into/out of the FIFO
+ */
+#define BCM2835_SPI_DLEN_MAX		65535
+#define BCM2835_SPI_FIFO_SIZE		64
+#define BCM2835_SPI_DMA_CHUNK		(BCM2835_SPI_DLEN_MAX & ~3)
+
+/* the thresholds for the strategy selection - 0 means calibrated value */
+static unsigned int polling_limit_us;
+module_param(polling_limit_us, uint, 0664);
+MODULE_PARM_DESC(polling_limit_us,
+		 "transfers expected to take less than this many us get polled "
+		 "(0 = use the value calibrated at probe)");
+
+static unsigned int sync_polling_limit_us = 100;
+module_param(sync_polling_limit_us, uint, 0664);
+MODULE_PARM_DESC(sync_polling_limit_us,
+		 "polling limit for messages run in the context of the caller "
+		 "of spi_sync (needs spi-sync-inline.patch) - polling there "
+		 "saves both the interrupt thread and the wakeup of the caller");
+
+static bool irq_coalesce = true;
+module_param(irq_coalesce, bool, 0664);
+MODULE_PARM_DESC(irq_coalesce,
+		 "only interrupt on RXR while data is queued and on DONE for "
+		 "the tail, instead of both all the time");
+
+static unsigned int max_hold_us = 1000;
+module_param(max_hold_us, uint, 0664);
+MODULE_PARM_DESC(max_hold_us,
+		 "split transfers of devices that tolerate CS changes into "
+		 "pieces of this many us, so others get the bus in between "
+		 "(0 = off)");
+
+static int autosuspend_ms = 100;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms,
+		 "gate the clock after the bus has been idle for this many ms "
+		 "(-1 = never) - power/autosuspend_delay_ms changes it later");
+
+static bool calibrate = true;
+module_param(calibrate, bool, 0444);
+MODULE_PARM_DESC(calibrate,
+		 "time the transfer methods at probe to find the thresholds");
+
+/* the ways we can run a transfer */
+enum bcm2835_spi_method {
+	BCM2835_SPI_METHOD_POLL,
+	BCM2835_SPI_METHOD_IRQ,
+	BCM2835_SPI_METHOD_DMA,
+};
+
+/*
+ * the progress of a message - kept apart, so that a preempted message
+ * can be saved and restored as a whole (see bcm2835_spi_run_message)
+ */
+struct bcm2835_spi_cursor {
+	/* the message and transfer currently processed */
+	struct spi_message *mesg;
+	struct bcm2835_spi_msg_ext *ext;
+	struct spi_transfer *tfr;
+	unsigned int tfr_index; /* the position of tfr in the message */
+	bool tfr_started;
+	/* the piece of the transfer currently processed */
+	unsigned int seg_offset;
+	unsigned int seg_len;
+	unsigned int seg_held; /* bytes since CS got asserted */
+	bool seg_release; /* release CS after the piece */
+	/* when the transfer started and the HW reported it DONE -
+	 * only recorded if ts_enabled
+	 */
+	bool ts_enabled;
+	ktime_t ts_start;
+	ktime_t ts_done;
+	u32 prio; /* the priority of the message */
+};
+
+struct bcm2835_spi {
+	void __iomem *regs;
+	struct clk *clk;
+	int irq;
+	struct completion done;
+	const u8 *tx_buf;
+	u8 *rx_buf;
+	int tx_len;
+	int rx_len;
+	u8 bits_per_word;
+	u8 swap; /* bytes per word - 1 for 16/32 bit words, otherwise 0 */
+	/* packed LoSSI: the D/C bit for the bytes and whether the next
+	 * byte is a command (sent without it) instead
+	 */
+	u16 lossi_dc;
+	bool lossi_cmd;
+	bool fifo_long;
+	/* where the running message is at */
+	struct bcm2835_spi_cursor cur;
+	/* the extension to accumulate CRCs in for the running transfer */
+	struct bcm2835_spi_msg_ext *crc_ext;
+	int xfer_err; /* error of a transfer finishing asynchronously */
+	/* bumped whenever the running message makes progress, so that
+	 * BCM2835_SPI_TIMEOUT_MS applies per piece and not per message
+	 */
+	unsigned int heartbeat;
+	int err;
+	/* whether the message got preempted by messages above
+	 * preempt_prio (at most preempt_max of them)
+	 */
+	bool preempted;
+	s64 preempt_prio;
+	unsigned int preempt_max;
+	/* nesting level of messages not mapped by the SPI core */
+	unsigned int pio_only;
+	spinlock_t cspol_lock;
+	u32 cspol;
+	/* the core clock - its rate is cached and clk_gen gets bumped on
+	 * every change: bcm2835_spi_clk_notifier holds off new transfers
+	 * (clk_changing) and waits for the one in flight (clk_busy) while
+	 * the rate changes, and stores the new rate in clk_rate_* - which
+	 * bcm2835_spi_process picks up into clk_hz and clk_gen before
+	 * starting the next transfer
+	 */
+	unsigned long clk_hz;
+	unsigned int clk_gen;
+	spinlock_t clk_rate_lock;
+	unsigned long clk_rate_hz;
+	unsigned int clk_rate_gen;
+	bool clk_changing;
+	bool clk_busy;
+	wait_queue_head_t clk_wq;
+	struct notifier_block clk_nb;
+#ifdef BCM2835_SPI_DMA
+	/* DMA related */
+	bool dma_enabled;
+	struct scatterlist *dma_sg_tx;
+	struct scatterlist *dma_sg_rx;
+	unsigned int dma_sg_len;
+	void *dma_tx_dummy;
+	dma_addr_t dma_tx_dummy_addr;
+	void *dma_rx_dummy;
+	dma_addr_t dma_rx_dummy_addr;
+	/* state of the running DMA transfer */
+	struct spi_transfer *dma_tfr;
+	unsigned int dma_offset;
+	unsigned int dma_end;
+	unsigned int dma_chunk; /* the start of the chunk in flight */
+	int dma_nrx; /* entries of dma_sg_rx of the chunk in flight */
+	u32 dma_cs;
+	bool dma_pending;
+	u32 dma_min_length;
+#endif
+	/* the message runs in the context of its submitter */
+	bool in_caller;
+	/* thresholds found by bcm2835_spi_calibrate */
+	u32 polling_limit_us;
+	/* statistics */
+	struct dentry *debugfs_dir;
+	u64 count_transfer_polling;
+	u64 count_transfer_irq;
+	u64 count_transfer_dma;
+	u64 count_irq;
+	u64 count_irq_bytes;
+	u64 count_preempt;
+	u64 count_in_caller;
+	u64 count_resume;
+	u64 time_resume_ns;
+};
+
+/* how to pick the clock divider if the requested speed can not be met */
+enum bcm2835_spi_clk_policy {
+	/* never exceed the requested speed (the default) */
+	BCM2835_SPI_CLK_ROUND_DOWN,
+	/* the closest speed, exceeding it by at most the tolerance */
+	BCM2835_SPI_CLK_NEAREST,
+	/* the closest speed, failing if it is off by more than the tolerance */
+	BCM2835_SPI_CLK_EXACT,
+};
+
+/* the number of speeds reported back per device that get mapped back to
+ * what had been requested - see bcm2835_spi_requested_speed
+ */
+#define BCM2835_SPI_SPEEDS	4
+
+/* per spi_device state kept in spi->controller_state */
+struct bcm2835_spi_state {
+	u32 cs;
+	u16 cdiv;
+	u32 speed_hz; /* the effective speed of cdiv */
+	unsigned int clk_gen; /* bcm2835_spi.clk_gen cdiv was computed for */
+	enum bcm2835_spi_clk_policy clk_policy;
+	u32 clk_tolerance_ppm;
+	u32 priority;
+	bool cs_change_tolerant;
+	/* speeds reported back in spi_transfer.speed_hz and the ones
+	 * that had been asked for
+	 */
+	u32 reported_hz[BCM2835_SPI_SPEEDS];
+	u32 requested_hz[BCM2835_SPI_SPEEDS];
+	unsigned int next_speed;
+};
+
+/* the back end of the driver including this file */
+static int bcm2835_spi_prepare_transfer(struct spi_device *spi,
+		struct spi_transfer *tfr, unsigned long clk_hz,
+		u32 *cs, u32 *cdiv);
+#ifdef BCM2835_SPI_DMA
+static int bcm2835_spi_start_dma(struct spi_master *master,
+		struct spi_transfer *tfr, unsigned int offset,
+		unsigned int len, u32 cs);
+static void bcm2835_spi_stop_dma(struct spi_master *master);
+#else
+static inline int bcm2835_spi_start_dma(struct spi_master *master,
+		struct spi_transfer *tfr, unsigned int offset,
+		unsigned int len, u32 cs)
+{
+	return -EINVAL;
+}
+
+static inline void bcm2835_spi_stop_dma(struct spi_master *master)
+{
+}
+#endif
+
+/*
+ * the clock divider for the fastest SCK not above spi_hz: the HW honours
+ * any even divider (the datasheet claims powers of two only, but see
+ * images/spi-cdiv_1_to_1024.csv), odd values get rounded down, so round
+ * up to the next even value. 0 means the slowest clock (65536) and
+ * values above 65536 mean that spi_hz can not be reached
+ */
+static inline unsigned long bcm2835_spi_cdiv(unsigned long clk_hz,
+					     unsigned long spi_hz)
+{
+	unsigned long cdiv;
+
+	if (!spi_hz)
+		return 0; /* 0 is the slowest we can go */
+	if (spi_hz >= clk_hz / 2)
+		return 2; /* clk_hz/2 is the fastest we can go */
+
+	cdiv = DIV_ROUND_UP(clk_hz, spi_hz);
+	/* make the divider "even" by rounding up
+	 * this ensures that the phases are of equal length
+	 */
+	cdiv += (cdiv % 2);
+
+	return cdiv;
+}
+
+/*
+ * the clock divider for spi_hz according to the policy of the device
+ * same encoding as bcm2835_spi_cdiv, the caller has to handle values
+ * of 65536 and above
+ */
+static int bcm2835_spi_select_cdiv(struct spi_device *spi,
+				   unsigned long clk_hz, unsigned long spi_hz,
+				   unsigned long *cdiv_out)
+{
+	struct bcm2835_spi_state *state = spi->controller_state;
+	unsigned long cdiv = bcm2835_spi_cdiv(clk_hz, spi_hz);
+	unsigned long hz, faster_hz, tolerance;
+
+	*cdiv_out = cdiv;
+	if (!state || state->clk_policy == BCM2835_SPI_CLK_ROUND_DOWN ||
+	    !spi_hz)
+		return 0;
+
+	tolerance = div_u64((u64)spi_hz * state->clk_tolerance_ppm, 1000000);
+	hz = clk_hz / min(cdiv, 65536UL);
+
+	/* the next faster divider may be closer and still acceptable */
+	if (cdiv > 2 && cdiv <= 65536) {
+		faster_hz = clk_hz / (cdiv - 2);
+		if ((faster_hz - spi_hz <= tolerance) &&
+		    (faster_hz - spi_hz < spi_hz - hz)) {
+			cdiv -= 2;
+			hz = faster_hz;
+		}
+	}
+
+	if ((state->clk_policy == BCM2835_SPI_CLK_EXACT) &&
+	    ((hz > spi_hz ? hz - spi_hz : spi_hz - hz) > tolerance)) {
+		dev_dbg(&spi->dev,
+			"%lu Hz not within %u ppm of %lu Hz (cdiv %lu)\n",
+			spi_hz, state->clk_tolerance_ppm, hz, cdiv);
+		return -EINVAL;
+	}
+
+	*cdiv_out = cdiv;
+	return 0;
+}
+
+static inline u32 bcm2835_rd(struct bcm2835_spi *bs, unsigned reg)
+{
+	return readl(bs->regs + reg);
+}
+
+static inline void bcm2835_wr(struct bcm2835_spi *bs, unsigned reg, u32 val)
+{
+	writel(val, bs->regs + reg);
+}
+
+static u32 bcm2835_spi_crc(enum bcm2835_spi_crc_type type, u32 crc,
+			   const u8 *buf, size_t len)
+{
+	switch (type) {
+	case BCM2835_SPI_CRC7:
+		return crc7_be(crc, buf, len);
+	case BCM2835_SPI_CRC16:
+		return crc_itu_t(crc, buf, len);
+	case BCM2835_SPI_CRC32:
+		return crc32_le(crc, buf, len);
+	default:
+		return crc;
+	}
+}
+
+/* account the bytes just moved through the FIFO - they are still hot */
+static inline void bcm2835_spi_crc_tx(struct bcm2835_spi *bs,
+				      const u8 *start)
+{
+	struct bcm2835_spi_msg_ext *ext = bs->crc_ext;
+
+	if (unlikely(ext) && start && (bs->tx_buf != start))
+		ext->crc_tx = bcm2835_spi_crc(ext->crc_type, ext->crc_tx,
+					      start, bs->tx_buf - start);
+}
+
+static inline void bcm2835_spi_crc_rx(struct bcm2835_spi *bs,
+				      const u8 *start)
+{
+	struct bcm2835_spi_msg_ext *ext = bs->crc_ext;
+
+	if (unlikely(ext) && start && (bs->rx_buf != start))
+		ext->crc_rx = bcm2835_spi_crc(ext->crc_type, ext->crc_rx,
+					      start, bs->rx_buf - start);
+}
+
+/*
+ * 16 and 32 bit words go out MSB first, but are stored in CPU (little
+ * endian) order - as words never straddle a piece of a transfer, the
+ * remaining length tells us the position k inside the current word and
+ * the byte that belongs on the wire now is the one at swap - 2 * k
+ */
+static inline int bcm2835_swap_offset(u8 swap, int len)
+{
+	return swap - 2 * (-len & swap);
+}
+
+/* the same for 4 bytes moved in one 32 bit FIFO access */
+static inline u32 bcm2835_swap_long(u8 swap, u32 val)
+{
+	if (swap == 3)
+		return swab32(val);
+	return swahb32(val);
+}
+
+static inline void bcm2835_rd_fifo(struct bcm2835_spi *bs)
+{
+	u8 *start = bs->rx_buf;
+	u8 byte;
+
+	while ( (bs->rx_len)
+		&& (bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_RXD)
+		) {
+		byte = bcm2835_rd(bs, BCM2835_SPI_FIFO);
+		if (bs->bits_per_word == 9) {
+			/* LoSSI reads return bytes, stored as u16 words */
+			if (bs->rx_buf) {
+				*(u16 *)bs->rx_buf = byte;
+				bs->rx_buf += 2;
+			}
+			bs->rx_len -= 2;
+			continue;
+		}
+		if (bs->rx_buf) {
+			bs->rx_buf[bcm2835_swap_offset(bs->swap,
+						       bs->rx_len)] = byte;
+			bs->rx_buf++;
+		}
+		bs->rx_len--;
+	}
+
+	bcm2835_spi_crc_rx(bs, start);
+}
+
+static inline void bcm2835_wr_fifo(struct bcm2835_spi *bs)
+{
+	const u8 *start = bs->tx_buf;
+	u32 val;
+
+	while ( (bs->tx_len)
+		&& (bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_TXD)
+		) {
+		val = 0;
+		if (bs->bits_per_word == 9) {
+			if (bs->tx_buf) {
+				val = *(const u16 *)bs->tx_buf;
+				bs->tx_buf += 2;
+			}
+			bs->tx_len-=2;
+		} else {
+			if (bs->tx_buf) {
+				val = bs->tx_buf[bcm2835_swap_offset(bs->swap,
+								     bs->tx_len)];
+				bs->tx_buf++;
+			}
+			bs->tx_len--;
+			/* packed LoSSI - expand the bytes to 9 bit words */
+			if (unlikely(bs->lossi_cmd))
+				bs->lossi_cmd = false;
+			else
+				val |= bs->lossi_dc;
+		}
+		bcm2835_wr(bs, BCM2835_SPI_FIFO, val);
+	}
+
+	bcm2835_spi_crc_tx(bs, start);
+}
+
+/*
+ * with DMAEN set every FIFO access moves 4 bytes (the first byte on the
+ * wire in the lowest byte) and DLEN tells the HW where the transfer ends.
+ * the RX FIFO may hold a partial word, so we only read whole blocks
+ * once RXR is set (12 words) or everything queued so far once the HW
+ * is DONE - which only means that the TX FIFO ran empty, and that
+ * happens in the middle of the transfer whenever a refill comes late
+ */
+static inline void bcm2835_rd_fifo_long(struct bcm2835_spi *bs)
+{
+	u32 cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+	u8 *start = bs->rx_buf;
+	u32 val;
+	int count, i;
+
+	if (cs & BCM2835_SPI_CS_DONE)
+		count = bs->rx_len - bs->tx_len;
+	else if (cs & BCM2835_SPI_CS_RXR)
+		count = min(bs->rx_len, 48);
+	else
+		return;
+
+	while (count > 0) {
+		val = bcm2835_rd(bs, BCM2835_SPI_FIFO);
+		if (bs->swap)
+			val = bcm2835_swap_long(bs->swap, val);
+		for (i = 0; i < 4 && i < count; i++) {
+			if (bs->rx_buf)
+				*bs->rx_buf++ = val >> (8 * i);
+		}
+		count -= i;
+		bs->rx_len -= i;
+	}
+
+	bcm2835_spi_crc_rx(bs, start);
+}
+
+static inline void bcm2835_wr_fifo_long(struct bcm2835_spi *bs)
+{
+	const u8 *start = bs->tx_buf;
+	u32 val;
+	int i;
+
+	while ( (bs->tx_len)
+		&& (bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_TXD)
+		) {
+		if (!bs->tx_buf) {
+			val = 0;
+			i = min(bs->tx_len, 4);
+		} else if (bs->tx_len >= 4) {
+			val = get_unaligned_le32(bs->tx_buf);
+			i = 4;
+		} else {
+			for (val = 0, i = 0; i < bs->tx_len; i++)
+				val |= bs->tx_buf[i] << (8 * i);
+		}
+		if (bs->tx_buf)
+			bs->tx_buf += i;
+		bs->tx_len -= i;
+		if (bs->swap)
+			val = bcm2835_swap_long(bs->swap, val);
+		bcm2835_wr(bs, BCM2835_SPI_FIFO, val);
+	}
+
+	bcm2835_spi_crc_tx(bs, start);
+}
+
+/*
+ * for TX only transfers we do not need what gets received, so instead of
+ * reading it byte by byte just clear the RX FIFO before it fills up and
+ * stalls the transfer - the transfer is done once everything is queued
+ * and the HW reports DONE
+ */
+static inline void bcm2835_service_fifo_tx_only(struct bcm2835_spi *bs)
+{
+	u32 cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+
+	if (cs & BCM2835_SPI_CS_RXD)
+		bcm2835_wr(bs, BCM2835_SPI_CS, cs | BCM2835_SPI_CS_CLEAR_RX);
+
+	if (bs->fifo_long)
+		bcm2835_wr_fifo_long(bs);
+	else
+		bcm2835_wr_fifo(bs);
+
+	if (bs->tx_len)
+		return;
+
+	cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+	if (cs & BCM2835_SPI_CS_DONE) {
+		/* and leave nothing behind for the next transfer */
+		bcm2835_wr(bs, BCM2835_SPI_CS, cs | BCM2835_SPI_CS_CLEAR_RX);
+		bs->rx_len = 0;
+	}
+}
+
+/* move data in both directions */
+static inline void bcm2835_service_fifo(struct bcm2835_spi *bs)
+{
+	if (!bs->rx_buf) {
+		bcm2835_service_fifo_tx_only(bs);
+		return;
+	}
+
+	if (bs->fifo_long) {
+		bcm2835_rd_fifo_long(bs);
+		bcm2835_wr_fifo_long(bs);
+	} else {
+		bcm2835_rd_fifo(bs);
+		bcm2835_wr_fifo(bs);
+	}
+}
+
+/* the interrupt sources we need in the current state of the transfer */
+static inline u32 bcm2835_spi_irq_mask(struct bcm2835_spi *bs)
+{
+	if (!irq_coalesce)
+		return BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD;
+
+	/* while there is data left to queue the TX FIFO is full, so the
+	 * RX FIFO is guaranteed to reach 3/4 (RXR) and we get one
+	 * interrupt per 48 bytes - for the tail we just wait for DONE
+	 */
+	return bs->tx_len ? BCM2835_SPI_CS_INTR : BCM2835_SPI_CS_INTD;
+}
+
+/*
+ * the hard interrupt handler only services the FIFOs, so that this
+ * happens with minimal latency even if interrupts get forced into
+ * threads - finishing the transfer is left to bcm2835_spi_irq_thread
+ */
+static irqreturn_t bcm2835_spi_interrupt(int irq, void *dev_id)
+{
+	struct spi_master *master = dev_id;
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	u32 cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+	u32 mask;
+	debug_set_high3();
+
+	bs->count_irq++;
+
+	/* Read and write as many bytes of data as possible */
+	bcm2835_service_fifo(bs);
+
+	/* if all data has been sent and received, then disable interrupts */
+	if (!bs->rx_len && !bs->tx_len) {
+		if (unlikely(bs->cur.ts_enabled))
+			bs->cur.ts_done = ktime_get();
+
+		/* Disable SPI interrupts */
+		cs &= ~(BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
+		bcm2835_wr(bs, BCM2835_SPI_CS, cs);
+
+		/* and let the thread finish it and start the next one */
+		debug_set_low3();
+		return IRQ_WAKE_THREAD;
+	} else {
+		/* switch interrupt sources once everything is queued */
+		mask = bcm2835_spi_irq_mask(bs);
+		if ((cs & (BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD)) != mask) {
+			cs &= ~(BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
+			bcm2835_wr(bs, BCM2835_SPI_CS, cs | mask);
+		}
+	}
+
+	debug_set_low3();
+	return IRQ_HANDLED;
+}
+
+/* service the FIFOs until the transfer is done */
+static void bcm2835_spi_poll(struct bcm2835_spi *bs)
+{
+	while (bs->rx_len || bs->tx_len)
+		bcm2835_service_fifo(bs);
+
+	if (unlikely(bs->cur.ts_enabled))
+		bs->cur.ts_done = ktime_get();
+}
+
+/*
+ * start len bytes of the transfer at offset with the given register
+ * settings and method - returns 0 if this is already done, 1 if it is
+ * in progress and the interrupt thread gets woken once done,
+ * or a negative error
+ */
+static int bcm2835_spi_start(struct spi_master *master,
+		struct spi_transfer *tfr, unsigned int offset, unsigned int len,
+		u32 cs, u32 cdiv, enum bcm2835_spi_method method)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	int err;
+
+	bs->xfer_err = 0;
+
+	bcm2835_wr(bs, BCM2835_SPI_CLK, cdiv);
+
+	if (method == BCM2835_SPI_METHOD_DMA) {
+		bs->count_transfer_dma++;
+		err = bcm2835_spi_start_dma(master, tfr, offset, len, cs);
+		return err ? err : 1;
+	}
+
+	bs->tx_buf = tfr->tx_buf ? tfr->tx_buf + offset : NULL;
+	bs->rx_buf = tfr->rx_buf ? tfr->rx_buf + offset : NULL;
+	bs->tx_len = len;
+	bs->rx_len = len;
+	bs->bits_per_word = tfr->bits_per_word;
+	bs->swap = (tfr->bits_per_word > 9) ? tfr->bits_per_word / 8 - 1 : 0;
+
+	/* use 32 bit FIFO accesses where the transfer allows it */
+	bs->fifo_long = (tfr->bits_per_word != 9) && !bs->lossi_dc &&
+			(len >= 4) &&
+			(len <= BCM2835_SPI_DLEN_MAX);
+	if (bs->fifo_long) {
+		bcm2835_wr(bs, BCM2835_SPI_DLEN, len);
+		cs |= BCM2835_SPI_CS_DMAEN;
+	}
+
+	/* Enable the HW block, but without the interrupts enabled,
+	 * so that we can fill in some data into the fifo now
+	 * and avoid delays due to interrupt overheads...
+	 */
+	bcm2835_wr(bs, BCM2835_SPI_CS, cs);
+	/* Write as many bytes of data as possible */
+	if (bs->fifo_long)
+		bcm2835_wr_fifo_long(bs);
+	else
+		bcm2835_wr_fifo(bs);
+
+	if (method == BCM2835_SPI_METHOD_POLL) {
+		bs->count_transfer_polling++;
+		bcm2835_spi_poll(bs);
+		return 0;
+	}
+
+	bs->count_transfer_irq++;
+	bs->count_irq_bytes += len;
+	/* and now enable the interrupts */
+	bcm2835_wr(bs, BCM2835_SPI_CS, cs | bcm2835_spi_irq_mask(bs));
+
+	return 1;
+}
+
+/*
+ * pick the cheapest way to run the transfer:
+ * - DMA if the core has mapped the buffers (see master->can_dma)
+ * - polling if the transfer takes less time on the wire than
+ *   the interrupt and wakeup of the worker thread would cost us
+ * - interrupts otherwise
+ */
+static enum bcm2835_spi_method bcm2835_spi_select_method(
+		struct bcm2835_spi *bs, struct spi_transfer *tfr,
+		unsigned int len, unsigned long cdiv, unsigned long clk_hz)
+{
+	u64 xfer_time_us;
+	unsigned int limit_us = polling_limit_us ? : bs->polling_limit_us;
+
+	/* this is decided by the core when mapping the message,
+	 * so we must not diverge from it here - unless we run a
+	 * message the core has not mapped or need to expand the
+	 * bytes to LoSSI words (TX only, so the mapping does no harm)
+	 */
+	if (!bs->pio_only && !bs->lossi_dc &&
+	    (tfr->tx_sg.nents || tfr->rx_sg.nents))
+		return BCM2835_SPI_METHOD_DMA;
+
+	/* calculate how long we have to wait aproximately */
+	xfer_time_us = (u64)(cdiv ? cdiv : 65536)
+		* 9 /* 8bit + 1 clock gap */
+		* len /* times the number of bytes to transfer */
+		* 1000000; /* get the measure in us */
+	xfer_time_us = div_u64(xfer_time_us, clk_hz);
+
+	if (bs->in_caller)
+		limit_us = max(limit_us, sync_polling_limit_us);
+
+	if (xfer_time_us <= limit_us)
+		return BCM2835_SPI_METHOD_POLL;
+
+	return BCM2835_SPI_METHOD_IRQ;
+}
+
+/*
+ * the number of bytes that fit into max_hold_us - a multiple of 4,
+ * so that DMA and 32 bit FIFO accesses stay aligned
+ */
+static unsigned int bcm2835_spi_hold_len(unsigned long clk_hz, u32 cdiv)
+{
+	u64 len = div_u64((u64)max_hold_us * clk_hz,
+			  (cdiv ? cdiv : 65536) * 9 * 1000000ULL);
+
+	return max_t(u64, round_down(len, 4), 4);
+}
+
+/* whether the first byte of tfr is a command - see lossi_cmd_mask */
+static bool bcm2835_spi_lossi_cmd(struct bcm2835_spi_msg_ext *ext,
+				  struct spi_message *mesg,
+				  struct spi_transfer *tfr)
+{
+	struct spi_transfer *t;
+	unsigned int n = 0;
+
+	list_for_each_entry(t, &mesg->transfers, transfer_list) {
+		if (t == tfr)
+			return n < 32 && (ext->lossi_cmd_mask & BIT(n));
+		n++;
+	}
+
+	return false;
+}
+
+/* the rate change has been announced, but never finished */
+static void bcm2835_spi_clk_resync(struct bcm2835_spi *bs)
+{
+	/* waits for a change still in progress */
+	unsigned long rate = clk_get_rate(bs->clk);
+	unsigned long flags;
+
+	spin_lock_irqsave(&bs->clk_rate_lock, flags);
+	if (bs->clk_changing) {
+		bs->clk_changing = false;
+		if (rate != bs->clk_rate_hz) {
+			bs->clk_rate_hz = rate;
+			bs->clk_rate_gen++;
+		}
+	}
+	spin_unlock_irqrestore(&bs->clk_rate_lock, flags);
+}
+
+/*
+ * a transfer is about to start - wait for a rate change of the core
+ * clock to finish and pick up the new rate, the divider caches notice
+ * the new clk_gen and recompute
+ */
+static void bcm2835_spi_clk_get(struct bcm2835_spi *bs)
+{
+	unsigned long flags;
+
+	for (;;) {
+		spin_lock_irqsave(&bs->clk_rate_lock, flags);
+		if (!bs->clk_changing) {
+			bs->clk_busy = true;
+			bs->clk_hz = bs->clk_rate_hz;
+			bs->clk_gen = bs->clk_rate_gen;
+			spin_unlock_irqrestore(&bs->clk_rate_lock, flags);
+			return;
+		}
+		spin_unlock_irqrestore(&bs->clk_rate_lock, flags);
+
+		if (!wait_event_timeout(bs->clk_wq,
+				!ACCESS_ONCE(bs->clk_changing),
+				msecs_to_jiffies(BCM2835_SPI_CLK_CHANGE_MS)))
+			bcm2835_spi_clk_resync(bs);
+	}
+}
+
+/* the transfer is done (or has been given up), the rate may change */
+static void bcm2835_spi_clk_put(struct bcm2835_spi *bs)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bs->clk_rate_lock, flags);
+	bs->clk_busy = false;
+	spin_unlock_irqrestore(&bs->clk_rate_lock, flags);
+
+	wake_up(&bs->clk_wq);
+}
+
+/*
+ * a resubmitted transfer carries the effective speed we reported back
+ * for it, which after a change of the core clock no longer matches the
+ * speed asked for - so map it back, instead of slowing down further
+ * with every change
+ */
+static u32 bcm2835_spi_requested_speed(struct bcm2835_spi_state *state,
+				       u32 hz)
+{
+	unsigned int i;
+
+	if (!state || !hz)
+		return hz;
+
+	for (i = 0; i < BCM2835_SPI_SPEEDS; i++)
+		if (state->reported_hz[i] == hz)
+			return state->requested_hz[i];
+
+	return hz;
+}
+
+/* report the speed we actually run at - and remember what was asked */
+static void bcm2835_spi_report_speed(struct bcm2835_spi_state *state,
+				     struct spi_transfer *tfr,
+				     u32 requested_hz, u32 hz)
+{
+	unsigned int i;
+
+	tfr->speed_hz = hz;
+	if (!state || hz == requested_hz)
+		return;
+
+	for (i = 0; i < BCM2835_SPI_SPEEDS; i++)
+		if (state->reported_hz[i] == hz)
+			break;
+	if (i == BCM2835_SPI_SPEEDS)
+		i = state->next_speed++ % BCM2835_SPI_SPEEDS;
+
+	state->reported_hz[i] = hz;
+	state->requested_hz[i] = requested_hz;
+}
+
+/* start the next piece of the transfer at bs->cur.seg_offset */
+static int bcm2835_spi_start_transfer(struct spi_device *spi,
+		struct spi_transfer *tfr)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct bcm2835_spi_state *state = spi->controller_state;
+	unsigned long clk_hz = bs->clk_hz;
+	unsigned int len, hold, step;
+	u32 cs, cdiv, speed_hz;
+	int err;
+
+	speed_hz = bcm2835_spi_requested_speed(state, tfr->speed_hz);
+	tfr->speed_hz = speed_hz;
+	err = bcm2835_spi_prepare_transfer(spi, tfr, clk_hz, &cs, &cdiv);
+	if (err)
+		return err;
+
+	/* report the speed we actually run at - rounded up, so that
+	 * resubmitting the transfer at the same clock results in the
+	 * same divider
+	 */
+	bcm2835_spi_report_speed(state, tfr, speed_hz,
+				 DIV_ROUND_UP(clk_hz, cdiv ? cdiv : 65536));
+
+	/* do not hold the bus longer than max_hold_us if the device
+	 * does not mind CS getting released in the middle
+	 */
+	len = tfr->len - bs->cur.seg_offset;
+	bs->cur.seg_release = false;
+	if (max_hold_us && state && state->cs_change_tolerant) {
+		hold = bcm2835_spi_hold_len(clk_hz, cdiv);
+		/* earlier transfers (maybe at a faster clock) have used up
+		 * the budget already, so release CS before going on
+		 */
+		if (bs->cur.seg_held >= hold) {
+			bcm2835_wr(bs, BCM2835_SPI_CS,
+				   bcm2835_rd(bs, BCM2835_SPI_CS) &
+				   ~BCM2835_SPI_CS_TA);
+			bs->cur.seg_held = 0;
+		}
+		/* pieces stay multiples of 4, so offsets stay aligned for
+		 * DMA and never split a 16/32 bit word
+		 */
+		if (bs->cur.seg_held + len > hold) {
+			len = min(len,
+				  max(round_down(hold - bs->cur.seg_held, 4),
+				      4U));
+			bs->cur.seg_release = true;
+		}
+	}
+
+	/* and stop at the next progress report */
+	if (bs->cur.ext && bs->cur.ext->progress &&
+	    bs->cur.ext->progress_bytes) {
+		step = round_up(bs->cur.ext->progress_bytes, 4);
+		if (step - bs->cur.seg_offset % step < len) {
+			len = step - bs->cur.seg_offset % step;
+			bs->cur.seg_release = false;
+		}
+	}
+	bs->cur.seg_len = len;
+
+	/* checksum the transfer on the fly if the client asked for it */
+	bs->crc_ext = (bs->cur.ext && bs->cur.ext->crc_type &&
+		       bs->cur.ext->crc_tfr == tfr &&
+		       tfr->bits_per_word == 8) ? bs->cur.ext : NULL;
+
+	/* send the bytes as packed LoSSI words if the client asked for it */
+	bs->lossi_dc = 0;
+	bs->lossi_cmd = false;
+	if (bs->cur.ext && bs->cur.ext->lossi_packed &&
+	    tfr->bits_per_word == 8 && !tfr->rx_buf) {
+		cs |= BCM2835_SPI_CS_LEN;
+		bs->lossi_dc = BCM2835_SPI_LOSSI_DATA;
+		bs->lossi_cmd = !bs->cur.seg_offset &&
+			bcm2835_spi_lossi_cmd(bs->cur.ext, bs->cur.mesg, tfr);
+	}
+
+	if (unlikely(bs->cur.ts_enabled) && !bs->cur.seg_offset)
+		bs->cur.ts_start = ktime_get();
+
+	return bcm2835_spi_start(spi->master, tfr, bs->cur.seg_offset, len,
+			cs | BCM2835_SPI_CS_TA, cdiv,
+			bcm2835_spi_select_method(bs, tfr, len, cdiv, clk_hz));
+}
+
+static int bcm2835_spi_finish_transfer(struct spi_device *spi,
+		struct spi_transfer *tfr, bool last, bool cs_change)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	u32 cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+
+	/* Drain RX FIFO */
+	bcm2835_rd_fifo(bs);
+
+	if (last && tfr->delay_usecs) {
+		debug_set_high2();
+		udelay(tfr->delay_usecs);
+		debug_set_low2();
+	}
+
+	if (cs_change)
+		/* Clear TA flag */
+		bcm2835_wr(bs, BCM2835_SPI_CS, cs & ~BCM2835_SPI_CS_TA);
+
+	return 0;
+}
+
+/*
+ * clock single bytes until the device answers with the pattern the
+ * client waits for - see bcm2835_spi_msg_ext.wait_tfr - one byte at a
+ * time, so that nothing following the pattern gets lost
+ */
+static int bcm2835_spi_wait_pattern(struct spi_device *spi,
+		struct spi_transfer *tfr)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct bcm2835_spi_msg_ext *ext = bs->cur.ext;
+	unsigned int timeout_us = ext->wait_timeout_us ? :
+				  BCM2835_SPI_WAIT_TIMEOUT_US;
+	unsigned int sleep_us = 10;
+	ktime_t start = ktime_get();
+	u32 cs, cdiv;
+	u8 val;
+	int err;
+
+	ext->wait_bytes = 0;
+
+	if (tfr->bits_per_word != 8)
+		return -EINVAL;
+
+	err = bcm2835_spi_prepare_transfer(spi, tfr, bs->clk_hz, &cs, &cdiv);
+	if (err)
+		return err;
+	if (spi->mode & SPI_3WIRE)
+		cs |= BCM2835_SPI_CS_REN;
+
+	bcm2835_wr(bs, BCM2835_SPI_CLK, cdiv);
+	bcm2835_wr(bs, BCM2835_SPI_CS, cs | BCM2835_SPI_CS_TA);
+
+	for (;;) {
+		bcm2835_wr(bs, BCM2835_SPI_FIFO, 0xff);
+		while (!(bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_RXD))
+			cpu_relax();
+		val = bcm2835_rd(bs, BCM2835_SPI_FIFO);
+		ext->wait_bytes++;
+		/* the wait has its own timeout, not that of the message */
+		bs->heartbeat++;
+
+		if ((val & ext->wait_mask) == ext->wait_value)
+			return 0;
+		if (ext->wait_max_bytes &&
+		    ext->wait_bytes >= ext->wait_max_bytes)
+			return -ETIMEDOUT;
+		if (ktime_us_delta(ktime_get(), start) > timeout_us)
+			return -ETIMEDOUT;
+
+		/* the pump runs SCHED_FIFO, so cond_resched would not give
+		 * the CPU away - sleep once a quick answer is unlikely, and
+		 * back off for waits that take long (flash erase)
+		 */
+		if (ext->wait_bytes >= BCM2835_SPI_WAIT_SPIN_BYTES) {
+			usleep_range(sleep_us, 2 * sleep_us);
+			sleep_us = min_t(unsigned int, 2 * sleep_us,
+					 BCM2835_SPI_WAIT_SLEEP_MAX_US);
+		}
+	}
+}
+
+/* report when tfr was on the wire - see bcm2835_spi_msg_ext.timestamps */
+static void bcm2835_spi_timestamp(struct bcm2835_spi *bs,
+				  struct spi_transfer *tfr)
+{
+	struct bcm2835_spi_msg_ext *ext = bs->cur.ext;
+	unsigned int i = 2 * bs->cur.tfr_index;
+
+	if (ext && ext->timestamps && i + 1 < ext->num_timestamps) {
+		ext->timestamps[i] = bs->cur.ts_start;
+		ext->timestamps[i + 1] = bs->cur.ts_done;
+	}
+
+	trace_spi_bcm2835_transfer(bs->cur.mesg, tfr, bs->cur.ts_start,
+				   bs->cur.ts_done);
+}
+
+/*
+ * 3-wire register reads: a short write followed by a short read with
+ * CS held get run in one go - once the TX bytes have left the FIFO
+ * REN gets flipped and the read clocked right away, without finishing
+ * the first transfer and starting the second one in between.
+ * returns 1 if both transfers are done, 0 if they do not qualify
+ */
+static int bcm2835_spi_run_3wire(struct spi_device *spi,
+		struct spi_message *mesg, struct spi_transfer *tfr)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct bcm2835_spi_state *state = spi->controller_state;
+	struct spi_transfer *rx_tfr;
+	const u8 *tx;
+	u8 *rx;
+	u32 cs, cdiv, speed_hz;
+	int err, i;
+
+	if (!(spi->mode & SPI_3WIRE) || bs->cur.ext || bs->cur.seg_offset ||
+	    list_is_last(&tfr->transfer_list, &mesg->transfers))
+		return 0;
+
+	rx_tfr = list_next_entry(tfr, transfer_list);
+	if (!tfr->tx_buf || tfr->rx_buf || rx_tfr->tx_buf || !rx_tfr->rx_buf ||
+	    tfr->cs_change || tfr->delay_usecs ||
+	    tfr->bits_per_word != 8 || rx_tfr->bits_per_word != 8 ||
+	    tfr->speed_hz != rx_tfr->speed_hz ||
+	    !tfr->len || tfr->len > BCM2835_SPI_FIFO_SIZE ||
+	    !rx_tfr->len || rx_tfr->len > BCM2835_SPI_FIFO_SIZE ||
+	    tfr->tx_sg.nents || rx_tfr->rx_sg.nents)
+		return 0;
+
+	speed_hz = bcm2835_spi_requested_speed(state, tfr->speed_hz);
+	tfr->speed_hz = speed_hz;
+	err = bcm2835_spi_prepare_transfer(spi, tfr, bs->clk_hz, &cs, &cdiv);
+	if (err)
+		return err;
+
+	/* only worth it if we would poll anyway */
+	if (bcm2835_spi_select_method(bs, tfr, tfr->len + rx_tfr->len,
+				      cdiv, bs->clk_hz) !=
+	    BCM2835_SPI_METHOD_POLL)
+		return 0;
+
+	bcm2835_spi_report_speed(state, tfr, speed_hz,
+				 DIV_ROUND_UP(bs->clk_hz, cdiv ? cdiv : 65536));
+	rx_tfr->speed_hz = tfr->speed_hz;
+	bs->count_transfer_polling++;
+	bs->xfer_err = 0;
+
+	bcm2835_wr(bs, BCM2835_SPI_CLK, cdiv);
+	bcm2835_wr(bs, BCM2835_SPI_CS, cs | BCM2835_SPI_CS_TA);
+
+	/* both fit into the FIFO, so no need to check TXD/RXD */
+	if (unlikely(bs->cur.ts_enabled))
+		bs->cur.ts_start = ktime_get();
+	tx = tfr->tx_buf;
+	for (i = 0; i < tfr->len; i++)
+		bcm2835_wr(bs, BCM2835_SPI_FIFO, tx[i]);
+	while (!(bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_DONE))
+		cpu_relax();
+	if (unlikely(bs->cur.ts_enabled)) {
+		bs->cur.ts_done = ktime_get();
+		bcm2835_spi_timestamp(bs, tfr);
+		bs->cur.ts_start = bs->cur.ts_done;
+	}
+
+	/* turn the line around - dropping what got sampled while sending */
+	bcm2835_wr(bs, BCM2835_SPI_CS, cs | BCM2835_SPI_CS_TA |
+		   BCM2835_SPI_CS_REN | BCM2835_SPI_CS_CLEAR_RX);
+	for (i = 0; i < rx_tfr->len; i++)
+		bcm2835_wr(bs, BCM2835_SPI_FIFO, 0);
+
+	rx = rx_tfr->rx_buf;
+	for (i = 0; i < rx_tfr->len; i++) {
+		while (!(bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_RXD))
+			cpu_relax();
+		rx[i] = bcm2835_rd(bs, BCM2835_SPI_FIFO);
+	}
+	if (unlikely(bs->cur.ts_enabled))
+		bs->cur.ts_done = ktime_get();
+
+	mesg->actual_length += tfr->len;
+	return 1;
+}
+
+static u32 bcm2835_spi_msg_priority(struct spi_message *mesg)
+{
+	struct bcm2835_spi_state *state =
+		mesg->spi ? mesg->spi->controller_state : NULL;
+
+	return state ? state->priority : 0;
+}
+
+/*
+ * find the most urgent message in the queue of the SPI core that has a
+ * higher priority than prio and optionally take it off the queue
+ */
+static struct spi_message *bcm2835_spi_find_message(
+		struct spi_master *master, s64 prio, bool take)
+{
+	struct spi_message *mesg, *found = NULL;
+	unsigned long flags;
+	s64 p;
+
+	if (list_empty(&master->queue))
+		return NULL;
+
+	spin_lock_irqsave(&master->queue_lock, flags);
+	list_for_each_entry(mesg, &master->queue, queue) {
+		p = bcm2835_spi_msg_priority(mesg);
+		if (p > prio) {
+			found = mesg;
+			prio = p;
+		}
+	}
+	if (found && take)
+		list_del_init(&found->queue);
+	spin_unlock_irqrestore(&master->queue_lock, flags);
+
+	return found;
+}
+
+/*
+ * run the transfers of the current message one after the other until
+ * one of them has to wait for the HW - called from the worker thread
+ * for the first transfer and from the interrupt thread once a transfer
+ * in progress has finished, so that the worker thread only gets woken
+ * once the whole message is done
+ */
+static void bcm2835_spi_process(struct spi_master *master)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct spi_message *mesg = bs->cur.mesg;
+	struct spi_transfer *tfr;
+	bool last, cs_change;
+	int ret;
+
+	/* a transfer outside of a message - see bcm2835_spi_calibrate */
+	if (!mesg) {
+		complete(&bs->done);
+		return;
+	}
+
+	while ((tfr = bs->cur.tfr)) {
+		if (!bs->cur.tfr_started) {
+			bs->cur.tfr_started = true;
+			bcm2835_spi_clk_get(bs);
+			if (bs->cur.ext && bs->cur.ext->wait_tfr == tfr &&
+			    !bs->cur.seg_offset) {
+				ret = bcm2835_spi_wait_pattern(mesg->spi, tfr);
+				if (ret) {
+					bs->err = ret;
+					break;
+				}
+			}
+			ret = bcm2835_spi_run_3wire(mesg->spi, mesg, tfr);
+			if (ret > 0) {
+				/* and finish the read as if it was run */
+				tfr = list_next_entry(tfr, transfer_list);
+				bs->cur.tfr = tfr;
+				bs->cur.tfr_index++;
+				bs->cur.seg_len = tfr->len;
+				bs->rx_len = 0;
+			} else if (!ret) {
+				ret = bcm2835_spi_start_transfer(mesg->spi,
+								 tfr);
+				if (ret > 0)
+					return;
+			}
+			if (ret < 0) {
+				bs->err = ret;
+				break;
+			}
+		}
+
+		/* the transfer is done, so finish it */
+		if (bs->xfer_err) {
+			bs->err = bs->xfer_err;
+			break;
+		}
+
+		last = (bs->cur.seg_offset + bs->cur.seg_len >= tfr->len);
+		cs_change = last ? (tfr->cs_change ||
+			list_is_last(&tfr->transfer_list, &mesg->transfers)) :
+			bs->cur.seg_release;
+
+		ret = bcm2835_spi_finish_transfer(mesg->spi, tfr, last,
+						  cs_change);
+		if (ret) {
+			bs->err = ret;
+			break;
+		}
+
+		/* only count what has been received */
+		mesg->actual_length += (bs->cur.seg_len - bs->rx_len);
+		bs->cur.tfr_started = false;
+		bcm2835_spi_clk_put(bs);
+		bs->cur.seg_offset += bs->cur.seg_len;
+		bs->heartbeat++;
+		bs->cur.seg_held = cs_change ? 0 :
+				   bs->cur.seg_held + bs->cur.seg_len;
+
+		if (last && unlikely(bs->cur.ts_enabled))
+			bcm2835_spi_timestamp(bs, tfr);
+
+		if (bs->cur.ext && bs->cur.ext->progress &&
+		    bs->cur.ext->progress_bytes)
+			bs->cur.ext->progress(mesg, tfr, bs->cur.seg_offset,
+					      bs->cur.ext->context);
+
+		/* we have held the bus for max_hold_us, so let one of
+		 * the messages waiting with at least our priority run
+		 */
+		if (!last) {
+			if (cs_change &&
+			    bcm2835_spi_find_message(master,
+						     (s64)bs->cur.prio - 1,
+						     false)) {
+				bs->preempted = true;
+				bs->preempt_prio = (s64)bs->cur.prio - 1;
+				bs->preempt_max = 1;
+				break;
+			}
+			continue;
+		}
+
+		/* and move on to the next */
+		bs->cur.seg_offset = 0;
+		bs->cur.tfr_index++;
+		bs->cur.tfr = list_is_last(&tfr->transfer_list,
+					   &mesg->transfers) ?
+			NULL : list_next_entry(tfr, transfer_list);
+
+		/* CS is released, so a more urgent message may run now */
+		if (bs->cur.tfr && cs_change &&
+		    bcm2835_spi_find_message(master, bs->cur.prio, false)) {
+			bs->preempted = true;
+			bs->preempt_prio = bs->cur.prio;
+			bs->preempt_max = UINT_MAX;
+			break;
+		}
+	}
+
+	/* nothing is in flight after an error either */
+	bcm2835_spi_clk_put(bs);
+
+	/* Wake up bcm2835_spi_transfer_one() */
+	complete(&bs->done);
+}
+
+static irqreturn_t bcm2835_spi_irq_thread(int irq, void *dev_id)
+{
+	struct spi_master *master = dev_id;
+
+	bcm2835_spi_process(master);
+
+	return IRQ_HANDLED;
+}
+
+/* the batch a message is the carrier of - see bcm2835_spi_batch_async */
+static struct bcm2835_spi_batch *bcm2835_spi_get_batch(
+		struct spi_message *mesg)
+{
+	struct bcm2835_spi_batch *batch =
+		container_of(mesg, struct bcm2835_spi_batch, carrier);
+
+	if (mesg->state != batch || batch->magic != BCM2835_SPI_BATCH_MAGIC)
+		return NULL;
+
+	return batch;
+}
+
+/* the extensions of a message - see bcm2835_spi_message_set_ext */
+static struct bcm2835_spi_msg_ext *bcm2835_spi_get_ext(
+		struct spi_message *mesg)
+{
+	struct bcm2835_spi_msg_ext *ext = mesg->state;
+
+	if (!ext || bcm2835_spi_get_batch(mesg))
+		return NULL;
+	if (ext->magic != BCM2835_SPI_EXT_MAGIC || ext->mesg != mesg)
+		return NULL;
+
+	return ext;
+}
+
+static void bcm2835_spi_run_urgent(struct spi_master *master, s64 prio,
+				   unsigned int max);
+
+/*
+ * wait for bcm2835_spi_process to finish the message - the interrupt
+ * thread chains the transfers, so keep waiting as long as it gets on
+ */
+static unsigned long bcm2835_spi_wait_done(struct bcm2835_spi *bs)
+{
+	unsigned long timeout;
+	unsigned int beat;
+
+	do {
+		beat = ACCESS_ONCE(bs->heartbeat);
+		timeout = wait_for_completion_timeout(&bs->done,
+				msecs_to_jiffies(BCM2835_SPI_TIMEOUT_MS));
+	} while (!timeout && ACCESS_ONCE(bs->heartbeat) != beat);
+
+	return timeout;
+}
+
+/* run a single message and wait for it */
+static int bcm2835_spi_run_message(struct spi_master *master,
+		struct spi_message *mesg)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct bcm2835_spi_msg_ext *ext = bcm2835_spi_get_ext(mesg);
+	struct bcm2835_spi_cursor saved;
+	int err;
+	unsigned int timeout;
+	unsigned long flags;
+
+	bs->cur = (struct bcm2835_spi_cursor) {
+		.mesg = mesg,
+		.ext = ext,
+		.tfr = list_first_entry(&mesg->transfers, struct spi_transfer,
+					transfer_list),
+		.ts_enabled = (ext && ext->timestamps) ||
+			      trace_spi_bcm2835_transfer_enabled(),
+		.prio = bcm2835_spi_msg_priority(mesg),
+	};
+
+	for (;;) {
+		reinit_completion(&bs->done);
+		bs->preempted = false;
+		bs->err = 0;
+
+		bcm2835_spi_process(master);
+
+		debug_set_high2();
+		timeout = bcm2835_spi_wait_done(bs);
+		debug_set_low2();
+
+		err = bs->err;
+		if (!timeout || !bs->preempted)
+			break;
+
+		/* run the other messages while CS is released
+		 * and then continue where we stopped - the preemption
+		 * happens between pieces, so nothing is started or held
+		 */
+		bs->count_preempt++;
+		saved = bs->cur;
+		bcm2835_spi_run_urgent(master, bs->preempt_prio,
+				       bs->preempt_max);
+		bs->cur = saved;
+	}
+
+	if (!timeout) {
+		err = -ETIMEDOUT;
+		/* make sure that nothing touches the message any longer */
+		bcm2835_wr(bs, BCM2835_SPI_CS,
+			   BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX);
+		bcm2835_spi_stop_dma(master);
+		synchronize_irq(bs->irq);
+		bcm2835_spi_clk_put(bs);
+	}
+
+	/* abort a DMA that may still be running after an error */
+	bcm2835_spi_stop_dma(master);
+
+	/* Clear FIFOs, and disable the HW block */
+	spin_lock_irqsave(&bs->cspol_lock, flags);
+	bcm2835_wr(bs, BCM2835_SPI_CS,
+		BCM2835_SPI_CS_CLEAR_RX
+		| BCM2835_SPI_CS_CLEAR_TX
+		| bs->cspol );
+	spin_unlock_irqrestore(&bs->cspol_lock, flags);
+
+	bs->cur.mesg = NULL;
+	bs->crc_ext = NULL;
+	bs->lossi_dc = 0;
+
+	return err;
+}
+
+/*
+ * the messages of a batch never went through spi_async, so do the
+ * checks and fill in the defaults the SPI core would have done
+ */
+static int bcm2835_spi_validate_message(struct spi_master *master,
+		struct spi_message *mesg)
+{
+	struct spi_device *spi = mesg->spi;
+	struct spi_transfer *tfr;
+
+	if (!spi || spi->master != master || list_empty(&mesg->transfers))
+		return -EINVAL;
+
+	list_for_each_entry(tfr, &mesg->transfers, transfer_list) {
+		if (!tfr->speed_hz)
+			tfr->speed_hz = spi->max_speed_hz;
+		if (!tfr->bits_per_word)
+			tfr->bits_per_word = spi->bits_per_word;
+		if (!(master->bits_per_word_mask &
+		      SPI_BPW_MASK(tfr->bits_per_word)))
+			return -EINVAL;
+		if (tfr->len % DIV_ROUND_UP(tfr->bits_per_word, 8))
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* run all messages of a batch, returns the first error */
+static int bcm2835_spi_run_batch(struct spi_master *master,
+		struct bcm2835_spi_batch *batch)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct spi_message *mesg;
+	unsigned int i;
+	int err = 0;
+
+	bs->pio_only++;
+	for (i = 0; i < batch->num; i++) {
+		mesg = batch->msgs[i];
+		mesg->actual_length = 0;
+		mesg->status = bcm2835_spi_validate_message(master, mesg);
+		if (!mesg->status)
+			mesg->status = bcm2835_spi_run_message(master, mesg);
+		if (mesg->status && !err)
+			err = mesg->status;
+	}
+	bs->pio_only--;
+
+	return err;
+}
+
+/* run a message or batch */
+static int bcm2835_spi_run_any(struct spi_master *master,
+		struct spi_message *mesg)
+{
+	struct bcm2835_spi_batch *batch = bcm2835_spi_get_batch(mesg);
+
+	if (batch)
+		return bcm2835_spi_run_batch(master, batch);
+
+	return bcm2835_spi_run_message(master, mesg);
+}
+
+/* deliver the completions of the messages of a batch in bulk */
+static void bcm2835_spi_complete_batch(struct spi_message *mesg)
+{
+	struct bcm2835_spi_batch *batch = bcm2835_spi_get_batch(mesg);
+	unsigned int i;
+
+	if (!batch)
+		return;
+
+	for (i = 0; i < batch->num; i++)
+		if (batch->msgs[i]->complete)
+			batch->msgs[i]->complete(batch->msgs[i]->context);
+}
+
+/*
+ * run up to max of the messages queued with a higher priority than prio
+ * right away, taking them from the queue of the SPI core. These have
+ * not been mapped for DMA, so they run in PIO mode
+ */
+static void bcm2835_spi_run_urgent(struct spi_master *master, s64 prio,
+				   unsigned int max)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct spi_message *mesg;
+	int err;
+
+	while (max-- && (mesg = bcm2835_spi_find_message(master, prio, true))) {
+		mesg->actual_length = 0;
+
+		bs->pio_only++;
+		err = bcm2835_spi_run_any(master, mesg);
+		bs->pio_only--;
+
+		/* what spi_finalize_current_message does for us otherwise */
+		bcm2835_spi_complete_batch(mesg);
+		mesg->state = NULL;
+		mesg->status = err;
+		if (mesg->complete)
+			mesg->complete(mesg->context);
+	}
+}
+
+static int bcm2835_spi_transfer_one(struct spi_master *master,
+		struct spi_message *mesg)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	int err;
+
+	debug_set_high();
+
+	/* with spi-sync-inline.patch applied the core runs messages
+	 * of spi_sync directly in the context of the caller
+	 */
+	bs->in_caller = (current != master->kworker_task);
+	if (bs->in_caller)
+		bs->count_in_caller++;
+
+	/* more urgent messages queued behind this one go first */
+	bcm2835_spi_run_urgent(master, bcm2835_spi_msg_priority(mesg),
+			       UINT_MAX);
+
+	err = bcm2835_spi_run_any(master, mesg);
+
+	bcm2835_spi_complete_batch(mesg);
+
+	mesg->status = err;
+	spi_finalize_current_message(master);
+
+	debug_set_low();
+	return 0;
+}
+
+/* keep the idle polarity of the chip-selects in sync with the devices */
+static void bcm2835_spi_set_cspol(struct spi_device *spi)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	u32 mask = BCM2835_SPI_CS_CSPOL0 << spi->chip_select;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bs->cspol_lock, flags);
+
+	/* clear the bit */
+	bs->cspol &= ~(mask);
+
+	/* set cspol correctly */
+	if (!(spi->mode & SPI_NO_CS)) {
+		if (spi->mode & SPI_CS_HIGH)
+			/* set the bit */
+			bs->cspol |= mask;
+	}
+
+	spin_unlock_irqrestore(&bs->cspol_lock, flags);
+}
+
+/*
+ * get the state of the device, allocating it on first use and reading
+ * the clock policy from the device tree node of the slave:
+ * - brcm,spi-clk-policy = "round-down", "nearest" or "exact"
+ * - brcm,spi-clk-tolerance-ppm = <tolerance>
+ * and its priority - messages of devices with a higher priority get
+ * run first and may preempt others where these release CS
+ * - brcm,spi-priority = <priority>
+ * - brcm,spi-cs-change-tolerant: CS may get released in the middle of
+ *   long transfers, see max_hold_us
+ */
+static struct bcm2835_spi_state *bcm2835_spi_get_state(struct spi_device *spi)
+{
+	struct bcm2835_spi_state *state = spi->controller_state;
+	const char *policy;
+
+	if (state)
+		return state;
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (!state)
+		return ERR_PTR(-ENOMEM);
+
+	state->clk_policy = BCM2835_SPI_CLK_ROUND_DOWN;
+	if (!of_property_read_string(spi->dev.of_node, "brcm,spi-clk-policy",
+				     &policy)) {
+		if (!strcmp(policy, "nearest")) {
+			state->clk_policy = BCM2835_SPI_CLK_NEAREST;
+		} else if (!strcmp(policy, "exact")) {
+			state->clk_policy = BCM2835_SPI_CLK_EXACT;
+		} else if (strcmp(policy, "round-down")) {
+			dev_err(&spi->dev, "unknown brcm,spi-clk-policy %s\n",
+				policy);
+			kfree(state);
+			return ERR_PTR(-EINVAL);
+		}
+	}
+	of_property_read_u32(spi->dev.of_node, "brcm,spi-clk-tolerance-ppm",
+			     &state->clk_tolerance_ppm);
+	of_property_read_u32(spi->dev.of_node, "brcm,spi-priority",
+			     &state->priority);
+	state->cs_change_tolerant = of_property_read_bool(spi->dev.of_node,
+					"brcm,spi-cs-change-tolerant");
+
+	spi->controller_state = state;
+
+	return state;
+}
+
+static void bcm2835_spi_cleanup(struct spi_device *spi)
+{
+	kfree(spi->controller_state);
+	spi->controller_state = NULL;
+}
+
+static void bcm2835_spi_core_init(struct bcm2835_spi *bs)
+{
+	init_completion(&bs->done);
+	spin_lock_init(&bs->cspol_lock);
+	bs->cspol = 0;
+	spin_lock_init(&bs->clk_rate_lock);
+	init_waitqueue_head(&bs->clk_wq);
+}
+
+/*
+ * the core clock follows the frequency scaling of the VPU, so let the
+ * transfer in flight finish at the old rate and hold off the next one
+ * until the new rate is known. No lock is held across the callbacks:
+ * the clk framework may send ABORT without PRE, or neither POST nor
+ * ABORT (see bcm2835_spi_clk_get)
+ */
+static int bcm2835_spi_clk_notifier(struct notifier_block *nb,
+				    unsigned long event, void *data)
+{
+	struct bcm2835_spi *bs = container_of(nb, struct bcm2835_spi, clk_nb);
+	struct clk_notifier_data *ndata = data;
+	unsigned long flags;
+
+	switch (event) {
+	case PRE_RATE_CHANGE:
+		spin_lock_irqsave(&bs->clk_rate_lock, flags);
+		bs->clk_changing = true;
+		spin_unlock_irqrestore(&bs->clk_rate_lock, flags);
+		wait_event_timeout(bs->clk_wq, !ACCESS_ONCE(bs->clk_busy),
+				   msecs_to_jiffies(BCM2835_SPI_TIMEOUT_MS));
+		break;
+	case POST_RATE_CHANGE:
+		spin_lock_irqsave(&bs->clk_rate_lock, flags);
+		bs->clk_rate_hz = ndata->new_rate;
+		bs->clk_rate_gen++;
+		bs->clk_changing = false;
+		spin_unlock_irqrestore(&bs->clk_rate_lock, flags);
+		wake_up(&bs->clk_wq);
+		break;
+	case ABORT_RATE_CHANGE:
+		spin_lock_irqsave(&bs->clk_rate_lock, flags);
+		bs->clk_changing = false;
+		spin_unlock_irqrestore(&bs->clk_rate_lock, flags);
+		wake_up(&bs->clk_wq);
+		break;
+	}
+
+	return NOTIFY_OK;
+}
+
+/* to be called once the clock is enabled */
+static void bcm2835_spi_clk_init(struct bcm2835_spi *bs, struct device *dev)
+{
+	bs->clk_hz = clk_get_rate(bs->clk);
+	bs->clk_rate_hz = bs->clk_hz;
+
+	bs->clk_nb.notifier_call = bcm2835_spi_clk_notifier;
+	if (clk_notifier_register(bs->clk, &bs->clk_nb)) {
+		dev_warn(dev, "can not track the rate of the core clock\n");
+		bs->clk_nb.notifier_call = NULL;
+	}
+}
+
+static void bcm2835_spi_clk_release(struct bcm2835_spi *bs)
+{
+	if (bs->clk_nb.notifier_call)
+		clk_notifier_unregister(bs->clk, &bs->clk_nb);
+}
+
+#ifdef CONFIG_PM
+static int bcm2835_spi_runtime_suspend(struct device *dev)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	clk_disable_unprepare(bs->clk);
+
+	return 0;
+}
+
+static int bcm2835_spi_runtime_resume(struct device *dev)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	ktime_t start = ktime_get();
+	int err;
+
+	err = clk_prepare_enable(bs->clk);
+	if (err)
+		return err;
+
+	/* the registers keep their contents while the clock is gated and
+	 * CLK gets written with every transfer, so just make sure that
+	 * the block is idle with the right chip-select polarity
+	 */
+	bcm2835_wr(bs, BCM2835_SPI_CS, ACCESS_ONCE(bs->cspol) |
+		   BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX);
+
+	bs->count_resume++;
+	bs->time_resume_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	return 0;
+}
+#endif
+
+static const struct dev_pm_ops bcm2835_spi_pm_ops = {
+	SET_RUNTIME_PM_OPS(bcm2835_spi_runtime_suspend,
+			   bcm2835_spi_runtime_resume, NULL)
+};
+
+/*
+ * the SPI core takes a runtime PM reference while it runs messages
+ * (master->auto_runtime_pm), so the clock gets gated autosuspend_ms
+ * after the bus went idle - called with the clock enabled
+ */
+static void bcm2835_spi_pm_init(struct spi_master *master,
+				struct device *dev)
+{
+	master->auto_runtime_pm = true;
+
+	pm_runtime_set_autosuspend_delay(dev, autosuspend_ms);
+	pm_runtime_use_autosuspend(dev);
+	pm_runtime_get_noresume(dev);
+	pm_runtime_set_active(dev);
+	pm_runtime_enable(dev);
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_put_autosuspend(dev);
+}
+
+/* undo bcm2835_spi_pm_init - leaves the clock enabled for the caller */
+static void bcm2835_spi_pm_release(struct device *dev)
+{
+	pm_runtime_get_sync(dev);
+	pm_runtime_disable(dev);
+	pm_runtime_dont_use_autosuspend(dev);
+	pm_runtime_put_noidle(dev);
+	pm_runtime_set_suspended(dev);
+}
+
+/*
+ * time a transfer of len bytes with the given method at the fastest
+ * clock and with no chip-select asserted - returns the best of a few
+ * runs in ns or a negative error
+ */
+static s64 bcm2835_spi_calibrate_method(struct spi_master *master,
+		enum bcm2835_spi_method method, unsigned int len)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct spi_transfer tfr = {
+		.len = len,
+		.bits_per_word = 8,
+	};
+	s64 ns, best = -ETIMEDOUT;
+	ktime_t start;
+	int i, err;
+
+	for (i = 0; i < 8; i++) {
+		reinit_completion(&bs->done);
+		start = ktime_get();
+		err = bcm2835_spi_start(master, &tfr, 0, len,
+					BCM2835_SPI_CS_TA |
+					BCM2835_SPI_CS_CS_10 |
+					BCM2835_SPI_CS_CS_01,
+					2, method);
+		if (err > 0)
+			err = wait_for_completion_timeout(&bs->done,
+					msecs_to_jiffies(100)) ? 0 : -ETIMEDOUT;
+		if (!err)
+			err = bs->xfer_err;
+		if (!err)
+			bcm2835_rd_fifo(bs);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		bcm2835_spi_stop_dma(master);
+		bcm2835_wr(bs, BCM2835_SPI_CS,
+			   BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX);
+		if (err)
+			return err;
+
+		if (best < 0 || ns < best)
+			best = ns;
+	}
+
+	return best;
+}
+
+/*
+ * find the thresholds for bcm2835_spi_select_method by timing
+ * each of the methods instead of relying on fixed constants
+ */
+static void bcm2835_spi_calibrate(struct spi_master *master)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct device *dev = master->dev.parent;
+	s64 poll_ns, irq_ns;
+#ifdef BCM2835_SPI_DMA
+	s64 dma_ns, pio_ns, len;
+#endif
+
+	bs->polling_limit_us = BCM2835_SPI_POLLTIME_US;
+#ifdef BCM2835_SPI_DMA
+	bs->dma_min_length = BCM2835_SPI_DMA_MIN_LENGTH;
+#endif
+
+	if (!calibrate)
+		return;
+
+	/* polling pays off as long as the transfer takes less time
+	 * than the interrupt round-trip costs us
+	 */
+	poll_ns = bcm2835_spi_calibrate_method(master,
+					       BCM2835_SPI_METHOD_POLL, 1);
+	irq_ns = bcm2835_spi_calibrate_method(master,
+					      BCM2835_SPI_METHOD_IRQ, 1);
+	if (poll_ns < 0 || irq_ns < 0) {
+		dev_warn(dev, "calibration failed - using defaults\n");
+		return;
+	}
+	bs->polling_limit_us = clamp_t(u32, DIV_ROUND_UP(
+					max_t(s64, irq_ns - poll_ns, 0), 1000),
+				       1, 1000);
+
+#ifdef BCM2835_SPI_DMA
+	/* DMA pays off once the setup costs less than the CPU time
+	 * spent moving the bytes through the FIFO ourselves
+	 */
+	if (bs->dma_enabled) {
+		pio_ns = bcm2835_spi_calibrate_method(master,
+						      BCM2835_SPI_METHOD_POLL,
+						      64);
+		dma_ns = bcm2835_spi_calibrate_method(master,
+						      BCM2835_SPI_METHOD_DMA,
+						      64);
+		if (pio_ns > 0 && dma_ns > 0) {
+			/* the DMA overhead expressed in bytes of PIO */
+			len = div64_s64(max_t(s64, dma_ns - pio_ns, 0) * 64,
+					pio_ns);
+			bs->dma_min_length = clamp_t(u32, round_up(len, 4),
+						     16, BCM2835_SPI_DMA_CHUNK);
+		}
+	}
+
+	dev_info(dev, "calibrated: dma from %u bytes\n", bs->dma_min_length);
+#endif
+
+	/* the statistics should only reflect real transfers */
+	bs->count_transfer_polling = 0;
+	bs->count_transfer_irq = 0;
+	bs->count_transfer_dma = 0;
+	bs->count_irq = 0;
+	bs->count_irq_bytes = 0;
+
+	dev_info(dev, "calibrated: polling below %u us\n",
+		 bs->polling_limit_us);
+}
+
+/* interrupts per MiB moved in interrupt mode - to judge coalescing */
+static int bcm2835_debugfs_irq_per_mib_get(void *data, u64 *val)
+{
+	struct bcm2835_spi *bs = data;
+
+	*val = bs->count_irq_bytes ?
+		div64_u64(bs->count_irq << 20, bs->count_irq_bytes) : 0;
+
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(bcm2835_debugfs_irq_per_mib,
+			bcm2835_debugfs_irq_per_mib_get, NULL, "%llu\n");
+
+static void bcm2835_debugfs_create(struct bcm2835_spi *bs,
+		const char *dname)
+{
+	char name[64];
+	struct dentry *dir;
+
+	snprintf(name, sizeof(name), "%s-%s", DRV_NAME, dname);
+
+	dir = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+	bs->debugfs_dir = dir;
+
+	/* the thresholds found at probe */
+	debugfs_create_u32("polling_limit_us", 0444, dir,
+			   &bs->polling_limit_us);
+#ifdef BCM2835_SPI_DMA
+	debugfs_create_u32("dma_min_length", 0444, dir,
+			   &bs->dma_min_length);
+#endif
+
+	/* the counters */
+	debugfs_create_u64("count_transfer_polling", 0444, dir,
+			   &bs->count_transfer_polling);
+	debugfs_create_u64("count_transfer_irq", 0444, dir,
+			   &bs->count_transfer_irq);
+	debugfs_create_u64("count_transfer_dma", 0444, dir,
+			   &bs->count_transfer_dma);
+	debugfs_create_u64("count_irq", 0444, dir, &bs->count_irq);
+	debugfs_create_u64("count_irq_bytes", 0444, dir,
+			   &bs->count_irq_bytes);
+	debugfs_create_u64("count_preempt", 0444, dir, &bs->count_preempt);
+	debugfs_create_u64("count_in_caller", 0444, dir,
+			   &bs->count_in_caller);
+	debugfs_create_u64("count_resume", 0444, dir, &bs->count_resume);
+	debugfs_create_u64("time_resume_ns", 0444, dir,
+			   &bs->time_resume_ns);
+	debugfs_create_file("irq_per_mib", 0444, dir, bs,
+			    &bcm2835_debugfs_irq_per_mib);
+}
+
+static void bcm2835_debugfs_remove(struct bcm2835_spi *bs)
+{
+	debugfs_remove_recursive(bs->debugfs_dir);
+	bs->debugfs_dir = NULL;
+}
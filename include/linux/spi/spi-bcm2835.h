@@ -0,0 +1,183 @@
+/*
+ * extensions of the Broadcom BCM2835/BCM2708 SPI drivers for clients
+ *
+ * Copyright (C) 2015 Martin Sperl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __LINUX_SPI_SPI_BCM2835_H
+#define __LINUX_SPI_SPI_BCM2835_H
+
+#include <linux/ktime.h>
+#include <linux/spi/spi.h>
+#include <linux/string.h>
+
+#define BCM2835_SPI_BATCH_MAGIC		0x62617463
+#define BCM2835_SPI_EXT_MAGIC		0x65787420
+
+/**
+ * struct bcm2835_spi_batch - run several messages in one go
+ * @msgs: the messages to run, with spi set - they may address different
+ *	devices on the bus, but are not mapped for DMA, so keep them short
+ * @num: the number of messages
+ * @carrier: the message queued for the batch, its status is the one
+ *	of the first message that failed
+ * @carrier_xfer: the (empty) transfer of the carrier
+ * @magic: tells the driver that the carrier is a batch
+ *
+ * the messages get run back to back in one activation of the message
+ * pump, only CS and CLK get reprogrammed in between. The complete
+ * callbacks of the messages get called once all messages are done,
+ * right before the one of the batch itself.
+ */
+struct bcm2835_spi_batch {
+	struct spi_message **msgs;
+	unsigned int num;
+	/* private */
+	struct spi_message carrier;
+	struct spi_transfer carrier_xfer;
+	u32 magic;
+};
+
+/**
+ * bcm2835_spi_batch_async - queue a batch of messages
+ * @batch: the batch with msgs and num filled in
+ * @complete: called once all messages of the batch are done
+ * @context: passed to @complete
+ *
+ * only works for busses driven by spi-bcm2835 or spi-bcm2708 - other
+ * drivers would run the empty carrier message and not touch the batch
+ */
+static inline int bcm2835_spi_batch_async(struct bcm2835_spi_batch *batch,
+					  void (*complete)(void *context),
+					  void *context)
+{
+	if (!batch->num)
+		return -EINVAL;
+
+	spi_message_init(&batch->carrier);
+	memset(&batch->carrier_xfer, 0, sizeof(batch->carrier_xfer));
+	spi_message_add_tail(&batch->carrier_xfer, &batch->carrier);
+	batch->carrier.complete = complete;
+	batch->carrier.context = context;
+	batch->carrier.state = batch;
+	batch->magic = BCM2835_SPI_BATCH_MAGIC;
+
+	return spi_async(batch->msgs[0]->spi, &batch->carrier);
+}
+
+/* checksums the driver can compute while the data passes the FIFO */
+enum bcm2835_spi_crc_type {
+	BCM2835_SPI_CRC_NONE,
+	/* crc7_be() - MMC commands, the result is in bits 7..1 */
+	BCM2835_SPI_CRC7,
+	/* crc_itu_t() - MMC data blocks */
+	BCM2835_SPI_CRC16,
+	/* crc32_le() */
+	BCM2835_SPI_CRC32,
+};
+
+/**
+ * struct bcm2835_spi_msg_ext - optional extensions of a message
+ * @progress: called whenever another @progress_bytes of a transfer
+ *	have been received (and at its end) with the number of bytes
+ *	received so far - from the context processing the message, so
+ *	it must not sleep
+ * @progress_bytes: the distance between two calls of @progress,
+ *	rounded up to a multiple of 4, 0 for no progress reports
+ * @context: passed to @progress
+ * @wait_tfr: optional transfer of the message to wait in front of - the
+ *	driver clocks out single bytes of 0xff (with CS asserted) until
+ *	one is received that matches @wait_value under @wait_mask, and then
+ *	continues straight with @wait_tfr; the matching byte (e.g. the
+ *	start token of a MMC data block) is not part of @wait_tfr
+ * @wait_value: the value to wait for
+ * @wait_mask: the bits of the received bytes to compare with @wait_value
+ * @wait_max_bytes: fail the message with -ETIMEDOUT after clocking this
+ *	many bytes without a match (0 = no limit)
+ * @wait_timeout_us: fail the message with -ETIMEDOUT after waiting this
+ *	long (0 = 250ms) - this is the only bound of the wait, it does not
+ *	count against the timeout of the driver; after the first few
+ *	bytes the driver sleeps between polls (backing off up to 1ms), so
+ *	long waits cost latency rather than CPU time
+ * @wait_bytes: set to the number of bytes clocked while waiting,
+ *	including the matching one
+ * @crc_tfr: optional transfer of the message to checksum - only with
+ *	8 bits per word
+ * @crc_type: the checksum to compute over @crc_tfr
+ * @crc_tx: the seed for the checksum of tx_buf on submission, the
+ *	checksum once the message is done (untouched without tx_buf)
+ * @crc_rx: the same for rx_buf
+ * @lossi_packed: send the 8 bit transfers without rx_buf of the message
+ *	to a LoSSI device as 9 bit words, one per byte of tx_buf, with the
+ *	D/C bit set (data) - so pixel data need not be expanded to u16 words
+ * @lossi_cmd_mask: bit n set makes the first byte of the n-th transfer
+ *	(counting from 0, at most 32) a command, with the D/C bit clear
+ * @timestamps: optional array that receives ktime_get() at the first
+ *	FIFO write (entry 2n) and at DONE (entry 2n + 1) of the n-th
+ *	transfer - bytes in between went over the wire at an even pace,
+ *	so the time a sample was clocked can be interpolated
+ * @num_timestamps: the number of entries in @timestamps
+ * @mesg: the message the extension belongs to
+ * @magic: tells the driver that mesg->state is an extension
+ *
+ * the transfers keep CS asserted between progress reports, they just
+ * get run in pieces, so a streaming client can process data while the
+ * rest is still being received. Pieces may still use DMA, the driver
+ * syncs what has been received for the CPU before calling @progress.
+ *
+ * waiting for a pattern replaces the message per polled byte that
+ * MMC-over-SPI or flash busy waits would need otherwise - @wait_tfr
+ * has to use 8 bits per word.
+ */
+struct bcm2835_spi_msg_ext {
+	void (*progress)(struct spi_message *mesg, struct spi_transfer *tfr,
+			 unsigned int rx_bytes, void *context);
+	unsigned int progress_bytes;
+	void *context;
+	struct spi_transfer *wait_tfr;
+	u8 wait_value;
+	u8 wait_mask;
+	unsigned int wait_max_bytes;
+	unsigned int wait_timeout_us;
+	unsigned int wait_bytes;
+	struct spi_transfer *crc_tfr;
+	enum bcm2835_spi_crc_type crc_type;
+	u32 crc_tx;
+	u32 crc_rx;
+	bool lossi_packed;
+	u32 lossi_cmd_mask;
+	ktime_t *timestamps;
+	unsigned int num_timestamps;
+	/* private */
+	struct spi_message *mesg;
+	u32 magic;
+};
+
+/**
+ * bcm2835_spi_message_set_ext - attach extensions to a message
+ * @mesg: the message
+ * @ext: the extensions
+ *
+ * the extensions live in mesg->state, which the SPI core clears once
+ * the message is done, so this has to be repeated before every
+ * submission of the message
+ */
+static inline void bcm2835_spi_message_set_ext(struct spi_message *mesg,
+					       struct bcm2835_spi_msg_ext *ext)
+{
+	ext->mesg = mesg;
+	ext->magic = BCM2835_SPI_EXT_MAGIC;
+	mesg->state = ext;
+}
+
+#endif /* __LINUX_SPI_SPI_BCM2835_H */
@@ -0,0 +1,75 @@
+/*
+ * tracepoints of the Broadcom BCM2835 SPI driver
+ *
+ * Copyright (C) 2015 Martin Sperl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM spi_bcm2835
+
+#if !defined(_TRACE_SPI_BCM2835_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_SPI_BCM2835_H
+
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+#include <linux/spi/spi.h>
+
+/*
+ * a transfer has been on the wire from start (the first FIFO write)
+ * to done (the HW reporting DONE) - without the queueing and
+ * completion latencies of the spi:spi_transfer_* events
+ */
+TRACE_EVENT(spi_bcm2835_transfer,
+
+	TP_PROTO(struct spi_message *msg, struct spi_transfer *xfer,
+		 ktime_t start, ktime_t done),
+
+	TP_ARGS(msg, xfer, start, done),
+
+	TP_STRUCT__entry(
+		__field(	int,		bus_num		)
+		__field(	int,		chip_select	)
+		__field(	struct spi_transfer *,	xfer	)
+		__field(	int,		len		)
+		__field(	s64,		start_ns	)
+		__field(	s64,		done_ns		)
+	),
+
+	TP_fast_assign(
+		__entry->bus_num = msg->spi->master->bus_num;
+		__entry->chip_select = msg->spi->chip_select;
+		__entry->xfer = xfer;
+		__entry->len = xfer->len;
+		__entry->start_ns = ktime_to_ns(start);
+		__entry->done_ns = ktime_to_ns(done);
+	),
+
+	TP_printk("spi%d.%d %p len=%d start=%lld done=%lld (%lld ns)",
+		  (int)__entry->bus_num, (int)__entry->chip_select,
+		  __entry->xfer, __entry->len,
+		  __entry->start_ns, __entry->done_ns,
+		  __entry->done_ns - __entry->start_ns)
+);
+
+#endif /* _TRACE_SPI_BCM2835_H */
+
+/* this header lives outside of the kernel tree, it gets found through
+ * the -I of ccflags-y in the Makefile
+ */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH trace/events
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE spi_bcm2835
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
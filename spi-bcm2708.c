@@ -25,16 +25,20 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/spinlock.h>
+#include <linux/completion.h>
 #include <linux/clk.h>
 #include <linux/err.h>
 #include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/slab.h>
 #include <linux/io.h>
 #include <linux/spi/spi.h>
+#include <linux/spi/spi-bcm2835.h>
 #include <linux/interrupt.h>
 #include <linux/delay.h>
-#include <linux/log2.h>
-#include <linux/sched.h>
-#include <linux/wait.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <asm/unaligned.h>
 
 /* define some DEBUG pins */
 #include "bcm2835-gpio-debugpin.h"
@@ -42,65 +46,12 @@ DEFINE_DEBUG_PIN()  /* used to mark "in worker thread"  */
 DEFINE_DEBUG_PIN(2) /* used to mark "waiting on wakeup" */
 DEFINE_DEBUG_PIN(3) /* used to mark "in SPI-interrupt"  */
 
-/* SPI register offsets */
-#define SPI_CS			0x00
-#define SPI_FIFO		0x04
-#define SPI_CLK			0x08
-#define SPI_DLEN		0x0c
-#define SPI_LTOH		0x10
-#define SPI_DC			0x14
-
-/* Bitfields in CS */
-#define SPI_CS_LEN_LONG		0x02000000
-#define SPI_CS_DMA_LEN		0x01000000
-#define SPI_CS_CSPOL2		0x00800000
-#define SPI_CS_CSPOL1		0x00400000
-#define SPI_CS_CSPOL0		0x00200000
-#define SPI_CS_RXF		0x00100000
-#define SPI_CS_RXR		0x00080000
-#define SPI_CS_TXD		0x00040000
-#define SPI_CS_RXD		0x00020000
-#define SPI_CS_DONE		0x00010000
-#define SPI_CS_LEN		0x00002000
-#define SPI_CS_REN		0x00001000
-#define SPI_CS_ADCS		0x00000800
-#define SPI_CS_INTR		0x00000400
-#define SPI_CS_INTD		0x00000200
-#define SPI_CS_DMAEN		0x00000100
-#define SPI_CS_TA		0x00000080
-#define SPI_CS_CSPOL		0x00000040
-#define SPI_CS_CLEAR_RX		0x00000020
-#define SPI_CS_CLEAR_TX		0x00000010
-#define SPI_CS_CPOL		0x00000008
-#define SPI_CS_CPHA		0x00000004
-#define SPI_CS_CS_10		0x00000002
-#define SPI_CS_CS_01		0x00000001
-
-#define SPI_TIMEOUT_MS	150
+#define BCM2835_SPI_TIMEOUT_MS	150
 
 #define DRV_NAME	"bcm2708_spi"
 
-struct bcm2708_spi {
-	spinlock_t lock;
-	void __iomem *base;
-	int irq;
-	struct clk *clk;
-	bool stopping;
-
-	struct list_head queue;
-	struct workqueue_struct *workq;
-	struct work_struct work;
-	struct completion done;
-
-	const u8 *tx_buf;
-	u8 *rx_buf;
-	int len;
-};
-
-struct bcm2708_spi_state {
-	u32 cs;
-	u16 cdiv;
-};
+/* the shared core, without DMA support */
+#include "bcm2835-spi-core.h"
 
 /*
  * This function sets the ALT mode on the SPI pins so that we can use them with
@@ -128,286 +79,129 @@ static void bcm2708_init_pinmode(void)
 #undef SET_GPIO_ALT
 }
 
-static inline u32 bcm2708_rd(struct bcm2708_spi *bs, unsigned reg)
-{
-	return readl(bs->base + reg);
-}
-
-static inline void bcm2708_wr(struct bcm2708_spi *bs, unsigned reg, u32 val)
-{
-	writel(val, bs->base + reg);
-}
-
-static inline void bcm2708_rd_fifo(struct bcm2708_spi *bs, int len)
-{
-	u8 byte;
-
-	while (len--) {
-		byte = bcm2708_rd(bs, SPI_FIFO);
-		if (bs->rx_buf)
-			*bs->rx_buf++ = byte;
-	}
-}
-
-static inline void bcm2708_wr_fifo(struct bcm2708_spi *bs, int len)
-{
-	u8 byte;
-	u16 val;
-
-	if (len > bs->len)
-		len = bs->len;
-
-	if (unlikely(bcm2708_rd(bs, SPI_CS) & SPI_CS_LEN)) {
-		/* LoSSI mode */
-		if (unlikely(len % 2)) {
-			printk(KERN_ERR"bcm2708_wr_fifo: length must be even, skipping.\n");
-			bs->len = 0;
-			return;
-		}
-		while (len) {
-			if (bs->tx_buf) {
-				val = *(const u16 *)bs->tx_buf;
-				bs->tx_buf += 2;
-			} else
-				val = 0;
-			bcm2708_wr(bs, SPI_FIFO, val);
-			bs->len -= 2;
-			len -= 2;
-		}
-		return;
-	}
-
-	while (len--) {
-		byte = bs->tx_buf ? *bs->tx_buf++ : 0;
-		bcm2708_wr(bs, SPI_FIFO, byte);
-		bs->len--;
-	}
-}
-
-static irqreturn_t bcm2708_spi_interrupt(int irq, void *dev_id)
-{
-	struct spi_master *master = dev_id;
-	struct bcm2708_spi *bs = spi_master_get_devdata(master);
-	u32 cs;
-	debug_set_high3();
-
-	spin_lock(&bs->lock);
-
-	cs = bcm2708_rd(bs, SPI_CS);
-
-	if (cs & SPI_CS_DONE) {
-		if (bs->len) { /* first interrupt in a transfer */
-			/* fill the TX fifo with up to 16 bytes */
-			bcm2708_wr_fifo(bs, 16);
-		} else { /* transfer complete */
-			/* disable interrupts */
-			cs &= ~(SPI_CS_INTR | SPI_CS_INTD);
-			bcm2708_wr(bs, SPI_CS, cs);
-
-			/* drain RX FIFO */
-			while (cs & SPI_CS_RXD) {
-				bcm2708_rd_fifo(bs, 1);
-				cs = bcm2708_rd(bs, SPI_CS);
-			}
-
-			/* wake up our bh */
-			complete(&bs->done);
-		}
-	} else if (cs & SPI_CS_RXR) {
-		/* read 12 bytes of data */
-		bcm2708_rd_fifo(bs, 12);
-
-		/* write up to 12 bytes */
-		bcm2708_wr_fifo(bs, 12);
-	}
-
-	spin_unlock(&bs->lock);
-	debug_set_low3();
-
-	return IRQ_HANDLED;
-}
-
-static int bcm2708_setup_state(struct spi_master *master,
-		struct device *dev, struct bcm2708_spi_state *state,
-		u32 hz, u8 csel, u8 mode, u8 bpw)
+static int bcm2708_setup_state(struct spi_device *spi,
+		struct bcm2835_spi_state *state, u32 hz, u8 bpw)
 {
-	struct bcm2708_spi *bs = spi_master_get_devdata(master);
-	int cdiv;
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct device *dev = &spi->dev;
+	u8 csel = spi->chip_select;
+	u8 mode = spi->mode;
+	unsigned long cdiv;
 	unsigned long bus_hz;
 	u32 cs = 0;
+	int ret;
 
-	bus_hz = clk_get_rate(bs->clk);
-
-	if (hz >= bus_hz) {
-		cdiv = 2; /* bus_hz / 2 is as fast as we can go */
-	} else if (hz) {
-		cdiv = DIV_ROUND_UP(bus_hz, hz);
-
-		/* CDIV must be a power of 2, so round up */
-		cdiv = roundup_pow_of_two(cdiv);
-
-		if (cdiv > 65536) {
-			dev_dbg(dev,
-				"setup: %d Hz too slow, cdiv %u; min %ld Hz\n",
-				hz, cdiv, bus_hz / 65536);
-			return -EINVAL;
-		} else if (cdiv == 65536) {
-			cdiv = 0;
-		} else if (cdiv == 1) {
-			cdiv = 2; /* 1 gets rounded down to 0; == 65536 */
-		}
-	} else {
+	bus_hz = bs->clk_hz;
+
+	ret = bcm2835_spi_select_cdiv(spi, bus_hz, hz, &cdiv);
+	if (ret)
+		return ret;
+	if (cdiv > 65536) {
+		dev_dbg(dev, "setup: %d Hz too slow, cdiv %lu; min %ld Hz\n",
+			hz, cdiv, bus_hz / 65536);
+		return -EINVAL;
+	} else if (cdiv == 65536) {
 		cdiv = 0;
 	}
 
 	switch (bpw) {
 	case 8:
+	case 16:
+	case 32:
+		/* 16 and 32 bit words get byte swapped in the FIFO engine */
 		break;
 	case 9:
 		/* Reading in LoSSI mode is a special case. See 'BCM2835 ARM Peripherals' datasheet */
-		cs |= SPI_CS_LEN;
+		cs |= BCM2835_SPI_CS_LEN;
 		break;
 	default:
-		dev_dbg(dev, "setup: invalid bits_per_word %u (must be 8 or 9)\n",
+		dev_dbg(dev, "setup: invalid bits_per_word %u (must be 8, 9, 16 or 32)\n",
 			bpw);
 		return -EINVAL;
 	}
 
 	if (mode & SPI_CPOL)
-		cs |= SPI_CS_CPOL;
+		cs |= BCM2835_SPI_CS_CPOL;
 	if (mode & SPI_CPHA)
-		cs |= SPI_CS_CPHA;
+		cs |= BCM2835_SPI_CS_CPHA;
 
 	if (!(mode & SPI_NO_CS)) {
 		if (mode & SPI_CS_HIGH) {
-			cs |= SPI_CS_CSPOL;
-			cs |= SPI_CS_CSPOL0 << csel;
+			cs |= BCM2835_SPI_CS_CSPOL;
+			cs |= BCM2835_SPI_CS_CSPOL0 << csel;
 		}
 
 		cs |= csel;
 	} else {
-		cs |= SPI_CS_CS_10 | SPI_CS_CS_01;
+		cs |= BCM2835_SPI_CS_CS_10 | BCM2835_SPI_CS_CS_01;
 	}
 
 	if (state) {
 		state->cs = cs;
 		state->cdiv = cdiv;
+		state->speed_hz = DIV_ROUND_UP(bus_hz, cdiv ? cdiv : 65536);
+		state->clk_gen = bs->clk_gen;
 		dev_dbg(dev, "setup: want %d Hz; "
-			"bus_hz=%lu / cdiv=%u == %lu Hz; "
+			"bus_hz=%lu / cdiv=%lu == %lu Hz; "
 			"mode %u: cs 0x%08X\n",
-			hz, bus_hz, cdiv, bus_hz/cdiv, mode, cs);
+			hz, bus_hz, cdiv, bus_hz / (cdiv ? cdiv : 65536),
+			mode, cs);
 	}
 
 	return 0;
 }
 
-static int bcm2708_process_transfer(struct bcm2708_spi *bs,
-		struct spi_message *msg, struct spi_transfer *xfer)
+static int bcm2835_spi_prepare_transfer(struct spi_device *spi,
+		struct spi_transfer *tfr, unsigned long clk_hz,
+		u32 *cs, u32 *cdiv)
 {
-	struct spi_device *spi = msg->spi;
-	struct bcm2708_spi_state state, *stp;
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct bcm2835_spi_state state, *stp = spi->controller_state;
 	int ret;
-	u32 cs;
 
-	if (bs->stopping)
-		return -ESHUTDOWN;
+	if (!(tfr->tx_buf || tfr->rx_buf) && tfr->len) {
+		dev_dbg(&spi->dev, "missing rx or tx buf\n");
+		return -EINVAL;
+	}
 
-	if (xfer->bits_per_word || xfer->speed_hz) {
-		ret = bcm2708_setup_state(spi->master, &spi->dev, &state,
-			xfer->speed_hz ? xfer->speed_hz : spi->max_speed_hz,
-			spi->chip_select, spi->mode,
-			xfer->bits_per_word ? xfer->bits_per_word :
-				spi->bits_per_word);
+	/* the core clock has changed since we computed the divider */
+	if (stp->clk_gen != bs->clk_gen) {
+		ret = bcm2708_setup_state(spi, stp, spi->max_speed_hz,
+					  spi->bits_per_word);
 		if (ret)
 			return ret;
-
-		stp = &state;
-	} else {
-		stp = spi->controller_state;
-	}
-
-	reinit_completion(&bs->done);
-	bs->tx_buf = xfer->tx_buf;
-	bs->rx_buf = xfer->rx_buf;
-	bs->len = xfer->len;
-
-        /* start SPI */
-        bcm2708_wr(bs, SPI_CLK, stp->cdiv);
-        cs = stp->cs | SPI_CS_INTR | SPI_CS_TA;
-        bcm2708_wr(bs, SPI_CS, cs);
-
-        /* fill the TX fifo with up to 16 bytes */
-        bcm2708_wr_fifo(bs, 16);
-
-        /* enable interrupts */
-        cs = stp->cs | SPI_CS_INTR | SPI_CS_INTD | SPI_CS_TA;
-        bcm2708_wr(bs, SPI_CS, cs);
-
-	debug_set_high2();
-	ret = wait_for_completion_timeout(&bs->done,
-			msecs_to_jiffies(SPI_TIMEOUT_MS));
-	debug_set_low2();
-	if (ret == 0) {
-		dev_err(&spi->dev, "transfer timed out\n");
-		return -ETIMEDOUT;
 	}
 
-	if (xfer->delay_usecs) {
-		debug_set_high2();
-		udelay(xfer->delay_usecs);
-		debug_set_low2();
-	}
+	/* the core fills in speed_hz and bits_per_word from the device,
+	 * so only compute a new state if the transfer differs from it -
+	 * a speed reported back earlier has been mapped to the one
+	 * requested already, see bcm2835_spi_requested_speed
+	 */
+	if ((tfr->speed_hz && tfr->speed_hz != spi->max_speed_hz &&
+	     tfr->speed_hz != stp->speed_hz) ||
+	    (tfr->bits_per_word &&
+	     tfr->bits_per_word != spi->bits_per_word)) {
+		ret = bcm2708_setup_state(spi, &state,
+			tfr->speed_hz ? tfr->speed_hz : spi->max_speed_hz,
+			tfr->bits_per_word ? tfr->bits_per_word :
+				spi->bits_per_word);
+		if (ret)
+			return ret;
 
-	if (list_is_last(&xfer->transfer_list, &msg->transfers) ||
-			xfer->cs_change) {
-		/* clear TA and interrupt flags */
-		bcm2708_wr(bs, SPI_CS, stp->cs);
+		stp = &state;
 	}
 
-	msg->actual_length += (xfer->len - bs->len);
+	*cs = stp->cs | ACCESS_ONCE(bs->cspol);
+	*cdiv = stp->cdiv;
 
 	return 0;
 }
 
-static void bcm2708_work(struct work_struct *work)
-{
-	struct bcm2708_spi *bs = container_of(work, struct bcm2708_spi, work);
-	unsigned long flags;
-	struct spi_message *msg;
-	struct spi_transfer *xfer;
-	int status = 0;
-	debug_set_high();
-
-	spin_lock_irqsave(&bs->lock, flags);
-	while (!list_empty(&bs->queue)) {
-		msg = list_first_entry(&bs->queue, struct spi_message, queue);
-		list_del_init(&msg->queue);
-		spin_unlock_irqrestore(&bs->lock, flags);
-
-		list_for_each_entry(xfer, &msg->transfers, transfer_list) {
-			status = bcm2708_process_transfer(bs, msg, xfer);
-			if (status)
-				break;
-		}
-
-		msg->status = status;
-		msg->complete(msg->context);
-
-		spin_lock_irqsave(&bs->lock, flags);
-	}
-	spin_unlock_irqrestore(&bs->lock, flags);
-	debug_set_low();
-}
-
 static int bcm2708_spi_setup(struct spi_device *spi)
 {
-	struct bcm2708_spi *bs = spi_master_get_devdata(spi->master);
-	struct bcm2708_spi_state *state;
+	struct bcm2835_spi_state *state;
 	int ret;
 
-	if (bs->stopping)
-		return -ESHUTDOWN;
-
 	if (!(spi->mode & SPI_NO_CS) &&
 			(spi->chip_select > spi->master->num_chipselect)) {
 		dev_dbg(&spi->dev,
@@ -416,22 +210,15 @@ static int bcm2708_spi_setup(struct spi_device *spi)
 		return -EINVAL;
 	}
 
-	state = spi->controller_state;
-	if (!state) {
-		state = kzalloc(sizeof(*state), GFP_KERNEL);
-		if (!state)
-			return -ENOMEM;
-
-		spi->controller_state = state;
-	}
+	state = bcm2835_spi_get_state(spi);
+	if (IS_ERR(state))
+		return PTR_ERR(state);
 
-	ret = bcm2708_setup_state(spi->master, &spi->dev, state,
-		spi->max_speed_hz, spi->chip_select, spi->mode,
+	ret = bcm2708_setup_state(spi, state, spi->max_speed_hz,
 		spi->bits_per_word);
 	if (ret < 0) {
-		kfree(state);
-		spi->controller_state = NULL;
-                return ret;
+		bcm2835_spi_cleanup(spi);
+		return ret;
 	}
 
 	dev_dbg(&spi->dev,
@@ -439,67 +226,22 @@ static int bcm2708_spi_setup(struct spi_device *spi)
 		spi->chip_select, spi->max_speed_hz, spi->bits_per_word,
 		spi->mode, state->cs, state->cdiv);
 
-	return 0;
-}
-
-static int bcm2708_spi_transfer(struct spi_device *spi, struct spi_message *msg)
-{
-	struct bcm2708_spi *bs = spi_master_get_devdata(spi->master);
-	struct spi_transfer *xfer;
-	int ret;
-	unsigned long flags;
-
-	if (unlikely(list_empty(&msg->transfers)))
-		return -EINVAL;
-
-	if (bs->stopping)
-		return -ESHUTDOWN;
-
-	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
-		if (!(xfer->tx_buf || xfer->rx_buf) && xfer->len) {
-			dev_dbg(&spi->dev, "missing rx or tx buf\n");
-			return -EINVAL;
-		}
-
-		if (!xfer->bits_per_word || xfer->speed_hz)
-			continue;
-
-		ret = bcm2708_setup_state(spi->master, &spi->dev, NULL,
-			xfer->speed_hz ? xfer->speed_hz : spi->max_speed_hz,
-			spi->chip_select, spi->mode,
-			xfer->bits_per_word ? xfer->bits_per_word :
-				spi->bits_per_word);
-		if (ret)
-			return ret;
-	}
-
-	msg->status = -EINPROGRESS;
-	msg->actual_length = 0;
-
-	spin_lock_irqsave(&bs->lock, flags);
-	list_add_tail(&msg->queue, &bs->queue);
-	queue_work(bs->workq, &bs->work);
-	spin_unlock_irqrestore(&bs->lock, flags);
+	bcm2835_spi_set_cspol(spi);
 
 	return 0;
 }
 
-static void bcm2708_spi_cleanup(struct spi_device *spi)
-{
-	if (spi->controller_state) {
-		kfree(spi->controller_state);
-		spi->controller_state = NULL;
-	}
-}
-
 static int bcm2708_spi_probe(struct platform_device *pdev)
 {
 	struct resource *regs;
 	int irq, err = -ENOMEM;
 	struct clk *clk;
 	struct spi_master *master;
-	struct bcm2708_spi *bs;
+	struct bcm2835_spi *bs;
 
+	debug_init_pin();
+	debug_init_pin2();
+	debug_init_pin3();
 	debug_set_low();
 	debug_set_low2();
 	debug_set_low3();
@@ -534,65 +276,67 @@ static int bcm2708_spi_probe(struct platform_device *pdev)
 	master->mode_bits = SPI_CPOL | SPI_CPHA | SPI_CS_HIGH | SPI_NO_CS;
 
 	master->bus_num = pdev->id;
+	master->bits_per_word_mask = SPI_BPW_RANGE_MASK(8, 9) |
+		SPI_BPW_MASK(16) | SPI_BPW_MASK(32);
 	master->num_chipselect = 3;
 	master->setup = bcm2708_spi_setup;
-	master->transfer = bcm2708_spi_transfer;
-	master->cleanup = bcm2708_spi_cleanup;
+	master->transfer_one_message = bcm2835_spi_transfer_one;
+	master->cleanup = bcm2835_spi_cleanup;
 	master->dev.of_node = pdev->dev.of_node;
+	master->rt = 1;
 	platform_set_drvdata(pdev, master);
 
 	bs = spi_master_get_devdata(master);
 
-	spin_lock_init(&bs->lock);
-	INIT_LIST_HEAD(&bs->queue);
-	init_completion(&bs->done);
-	INIT_WORK(&bs->work, bcm2708_work);
+	bcm2835_spi_core_init(bs);
 
-	bs->base = ioremap(regs->start, resource_size(regs));
-	if (!bs->base) {
+	bs->regs = ioremap(regs->start, resource_size(regs));
+	if (!bs->regs) {
 		dev_err(&pdev->dev, "could not remap memory\n");
 		goto out_master_put;
 	}
 
-	bs->workq = create_singlethread_workqueue(dev_name(&pdev->dev));
-	if (!bs->workq) {
-		dev_err(&pdev->dev, "could not create workqueue\n");
-		goto out_iounmap;
-	}
-
 	bs->irq = irq;
 	bs->clk = clk;
-	bs->stopping = false;
 
-	err = request_irq(irq, bcm2708_spi_interrupt, 0, dev_name(&pdev->dev),
-			master);
+	err = request_threaded_irq(irq, bcm2835_spi_interrupt,
+				   bcm2835_spi_irq_thread, IRQF_NO_THREAD,
+				   dev_name(&pdev->dev), master);
 	if (err) {
 		dev_err(&pdev->dev, "could not request IRQ: %d\n", err);
-		goto out_workqueue;
+		goto out_iounmap;
 	}
 
 	/* initialise the hardware */
 	clk_prepare_enable(clk);
-	bcm2708_wr(bs, SPI_CS, SPI_CS_REN | SPI_CS_CLEAR_RX | SPI_CS_CLEAR_TX);
+	bcm2835_spi_clk_init(bs, &pdev->dev);
+	bcm2835_wr(bs, BCM2835_SPI_CS, BCM2835_SPI_CS_REN |
+		   BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX);
+
+	bcm2835_spi_calibrate(master);
+
+	bcm2835_spi_pm_init(master, &pdev->dev);
 
 	err = spi_register_master(master);
 	if (err) {
 		dev_err(&pdev->dev, "could not register SPI master: %d\n", err);
-		goto out_free_irq;
+		goto out_pm_release;
 	}
 
 	dev_info(&pdev->dev, "SPI Controller at 0x%08lx (irq %d)\n",
 		(unsigned long)regs->start, irq);
 
+	bcm2835_debugfs_create(bs, dev_name(&pdev->dev));
+
 	return 0;
 
-out_free_irq:
+out_pm_release:
+	bcm2835_spi_pm_release(&pdev->dev);
 	free_irq(bs->irq, master);
+	bcm2835_spi_clk_release(bs);
 	clk_disable_unprepare(bs->clk);
-out_workqueue:
-	destroy_workqueue(bs->workq);
 out_iounmap:
-	iounmap(bs->base);
+	iounmap(bs->regs);
 out_master_put:
 	spi_master_put(master);
 out_clk_put:
@@ -602,23 +346,28 @@ out_clk_put:
 
 static int bcm2708_spi_remove(struct platform_device *pdev)
 {
-	struct spi_master *master = platform_get_drvdata(pdev);
-	struct bcm2708_spi *bs = spi_master_get_devdata(master);
+	struct spi_master *master = spi_master_get(platform_get_drvdata(pdev));
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
 
-	/* reset the hardware and block queue progress */
-	spin_lock_irq(&bs->lock);
-	bs->stopping = true;
-	bcm2708_wr(bs, SPI_CS, SPI_CS_CLEAR_RX | SPI_CS_CLEAR_TX);
-	spin_unlock_irq(&bs->lock);
+	/* stops the message queue once the running message is done */
+	spi_unregister_master(master);
 
-	flush_work(&bs->work);
+	bcm2835_debugfs_remove(bs);
 
+	/* the clock has to run to reset the HW */
+	bcm2835_spi_pm_release(&pdev->dev);
+
+	/* reset the hardware */
+	bcm2835_wr(bs, BCM2835_SPI_CS,
+		   BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX);
+
+	bcm2835_spi_clk_release(bs);
 	clk_disable_unprepare(bs->clk);
 	clk_put(bs->clk);
 	free_irq(bs->irq, master);
-	iounmap(bs->base);
+	iounmap(bs->regs);
 
-	spi_unregister_master(master);
+	spi_master_put(master);
 
 	return 0;
 }
@@ -634,6 +383,7 @@ static struct platform_driver bcm2708_spi_driver = {
 		.name	= DRV_NAME,
 		.owner	= THIS_MODULE,
 		.of_match_table = bcm2708_spi_match,
+		.pm	= &bcm2835_spi_pm_ops,
 	},
 	.probe		= bcm2708_spi_probe,
 	.remove		= bcm2708_spi_remove,
@@ -652,9 +402,6 @@ static void __exit bcm2708_spi_exit(void)
 }
 module_exit(bcm2708_spi_exit);
 
-
-//module_platform_driver(bcm2708_spi_driver);
-
 MODULE_DESCRIPTION("SPI controller driver for Broadcom BCM2708");
 MODULE_AUTHOR("Chris Boot <bootc@bootc.net>");
 MODULE_LICENSE("GPL v2");
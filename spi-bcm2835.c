@@ -25,16 +25,25 @@
 
 #include <linux/clk.h>
 #include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/dmaengine.h>
 #include <linux/err.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/of.h>
+#include <linux/of_address.h>
 #include <linux/of_irq.h>
 #include <linux/of_device.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
 #include <linux/spi/spi.h>
+#include <linux/spi/spi-bcm2835.h>
+#include <asm/unaligned.h>
 
 /* define some DEBUG pins */
 #include "bcm2835-gpio-debugpin.h"
@@ -42,326 +51,492 @@ DEFINE_DEBUG_PIN()  /* used to mark "in worker thread"  */
 DEFINE_DEBUG_PIN(2) /* used to mark "waiting on wakeup" */
 DEFINE_DEBUG_PIN(3) /* used to mark "in SPI-interrupt"  */
 
-/* SPI register offsets */
-#define BCM2835_SPI_CS			0x00
-#define BCM2835_SPI_FIFO		0x04
-#define BCM2835_SPI_CLK			0x08
-#define BCM2835_SPI_DLEN		0x0c
-#define BCM2835_SPI_LTOH		0x10
-#define BCM2835_SPI_DC			0x14
-
-/* Bitfields in CS */
-#define BCM2835_SPI_CS_LEN_LONG		0x02000000
-#define BCM2835_SPI_CS_DMA_LEN		0x01000000
-#define BCM2835_SPI_CS_CSPOL2		0x00800000
-#define BCM2835_SPI_CS_CSPOL1		0x00400000
-#define BCM2835_SPI_CS_CSPOL0		0x00200000
-#define BCM2835_SPI_CS_RXF		0x00100000
-#define BCM2835_SPI_CS_RXR		0x00080000
-#define BCM2835_SPI_CS_TXD		0x00040000
-#define BCM2835_SPI_CS_RXD		0x00020000
-#define BCM2835_SPI_CS_DONE		0x00010000
-#define BCM2835_SPI_CS_LEN		0x00002000
-#define BCM2835_SPI_CS_REN		0x00001000
-#define BCM2835_SPI_CS_ADCS		0x00000800
-#define BCM2835_SPI_CS_INTR		0x00000400
-#define BCM2835_SPI_CS_INTD		0x00000200
-#define BCM2835_SPI_CS_DMAEN		0x00000100
-#define BCM2835_SPI_CS_TA		0x00000080
-#define BCM2835_SPI_CS_CSPOL		0x00000040
-#define BCM2835_SPI_CS_CLEAR_RX		0x00000020
-#define BCM2835_SPI_CS_CLEAR_TX		0x00000010
-#define BCM2835_SPI_CS_CPOL		0x00000008
-#define BCM2835_SPI_CS_CPHA		0x00000004
-#define BCM2835_SPI_CS_CS_10		0x00000002
-#define BCM2835_SPI_CS_CS_01		0x00000001
-
 #define BCM2835_SPI_TIMEOUT_MS	30000
 #define BCM2835_SPI_MODE_BITS	(SPI_CPOL | SPI_CPHA | SPI_CS_HIGH \
 				| SPI_NO_CS | SPI_3WIRE)
 
-/* the time we will poll the device */
-#define BCM2835_SPI_POLLTIME_US 20
-
 #define DRV_NAME	"spi-bcm2835"
 
-struct bcm2835_spi {
-	void __iomem *regs;
-	struct clk *clk;
-	int irq;
-	struct completion done;
-	const u8 *tx_buf;
-	u8 *rx_buf;
-	int len;
-	u8 bits_per_word;
-	spinlock_t cspol_lock;
-	u32 cspol;
-};
+#define CREATE_TRACE_POINTS
+#include <trace/events/spi_bcm2835.h>
+
+/* the shared core with DMA support and tracepoints enabled */
+#define BCM2835_SPI_DMA
+#define BCM2835_SPI_TRACE
+#include "bcm2835-spi-core.h"
+
+#define BCM2835_SPI_DMA_DUMMY_SG	\
+	DIV_ROUND_UP(BCM2835_SPI_DMA_CHUNK, PAGE_SIZE)
 
-static inline u32 bcm2835_rd(struct bcm2835_spi *bs, unsigned reg)
+static unsigned int dma_min_length;
+module_param(dma_min_length, uint, 0664);
+MODULE_PARM_DESC(dma_min_length,
+		 "transfers of at least this many bytes get run via DMA "
+		 "(0 = use the value calibrated at probe)");
+
+static bool bcm2835_spi_can_dma(struct spi_master *master,
+		struct spi_device *spi, struct spi_transfer *tfr)
 {
-	return readl(bs->regs + reg);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	if (!bs->dma_enabled)
+		return false;
+	/* only worth the setup overhead for longer transfers */
+	if (tfr->len < (dma_min_length ? : bs->dma_min_length))
+		return false;
+	/* the DMA moves 32 bit words, so LoSSI is out - and it can not
+	 * byte swap 16/32 bit words either
+	 */
+	if (tfr->bits_per_word != 8)
+		return false;
+	/* and every scatter-gather entry but the last has to be
+	 * a multiple of 4 bytes, which is given for aligned buffers
+	 * (pages are aligned as well)
+	 */
+	if (((unsigned long)tfr->tx_buf | (unsigned long)tfr->rx_buf) & 3)
+		return false;
+
+	return true;
 }
 
-static inline void bcm2835_wr(struct bcm2835_spi *bs, unsigned reg, u32 val)
+/*
+ * fill sgl with the dma-addresses that cover len bytes starting at
+ * offset inside the (already mapped) sg_table - entries get trimmed
+ * to the window, so the result describes exactly one DLEN chunk
+ */
+static int bcm2835_spi_dma_slice(struct scatterlist *sgl, unsigned int max,
+		struct sg_table *sgt, unsigned int offset, unsigned int len)
 {
-	writel(val, bs->regs + reg);
+	struct scatterlist *sg;
+	unsigned int n = 0, sg_len, chunk;
+	int i;
+
+	sg_init_table(sgl, max);
+	for_each_sg(sgt->sgl, sg, sgt->nents, i) {
+		sg_len = sg_dma_len(sg);
+		if (offset >= sg_len) {
+			offset -= sg_len;
+			continue;
+		}
+		if (n == max)
+			return -EINVAL;
+		chunk = min(sg_len - offset, len);
+		sg_dma_address(&sgl[n]) = sg_dma_address(sg) + offset;
+		sg_dma_len(&sgl[n]) = chunk;
+		n++;
+		offset = 0;
+		len -= chunk;
+		if (!len)
+			break;
+	}
+	if (len)
+		return -EINVAL;
+
+	sg_mark_end(&sgl[n - 1]);
+	return n;
 }
 
-static inline void bcm2835_rd_fifo(struct bcm2835_spi *bs)
+/* same as above for tx_buf/rx_buf == NULL - repeat a single dummy page */
+static int bcm2835_spi_dma_slice_dummy(struct scatterlist *sgl,
+		unsigned int max, dma_addr_t addr, unsigned int len)
 {
-	u8 byte;
-
-	while (bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_RXD) {
-		byte = bcm2835_rd(bs, BCM2835_SPI_FIFO);
-		if (bs->rx_buf)
-			*bs->rx_buf++ = byte;
+	unsigned int n = 0, chunk;
+
+	sg_init_table(sgl, max);
+	while (len) {
+		chunk = min_t(unsigned int, len, PAGE_SIZE);
+		sg_dma_address(&sgl[n]) = addr;
+		sg_dma_len(&sgl[n]) = chunk;
+		n++;
+		len -= chunk;
 	}
+
+	sg_mark_end(&sgl[n - 1]);
+	return n;
 }
 
-static inline void bcm2835_wr_fifo(struct bcm2835_spi *bs)
+static void bcm2835_spi_dma_done(void *data);
+
+/* start the next chunk of at most BCM2835_SPI_DMA_CHUNK bytes */
+static int bcm2835_spi_dma_chunk(struct spi_master *master)
 {
-	u32 val;
-
-	while ( (bs->len)
-		&& (bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_TXD)
-		) {
-		val = 0;
-		if (bs->bits_per_word == 9) {
-			if (bs->tx_buf) {
-				val = *(const u16 *)bs->tx_buf;
-				bs->tx_buf += 2;
-			}
-			bs->len-=2;
-		} else {
-			if (bs->tx_buf) {
-				val = *bs->tx_buf++;
-			}
-			bs->len--;
-		}
-		bcm2835_wr(bs, BCM2835_SPI_FIFO, val);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct spi_transfer *tfr = bs->dma_tfr;
+	struct dma_async_tx_descriptor *desc_tx, *desc_rx;
+	unsigned int len = min_t(unsigned int, bs->dma_end - bs->dma_offset,
+				 BCM2835_SPI_DMA_CHUNK);
+	int ntx, nrx;
+
+	if (tfr->tx_buf)
+		ntx = bcm2835_spi_dma_slice(bs->dma_sg_tx, bs->dma_sg_len,
+					    &tfr->tx_sg, bs->dma_offset, len);
+	else
+		ntx = bcm2835_spi_dma_slice_dummy(bs->dma_sg_tx,
+						  bs->dma_sg_len,
+						  bs->dma_tx_dummy_addr, len);
+	if (tfr->rx_buf)
+		nrx = bcm2835_spi_dma_slice(bs->dma_sg_rx, bs->dma_sg_len,
+					    &tfr->rx_sg, bs->dma_offset, len);
+	else
+		nrx = bcm2835_spi_dma_slice_dummy(bs->dma_sg_rx,
+						  bs->dma_sg_len,
+						  bs->dma_rx_dummy_addr, len);
+	if (ntx < 0 || nrx < 0)
+		return -EINVAL;
+
+	/* the rx side is the one that finishes last, so it signals us */
+	desc_rx = dmaengine_prep_slave_sg(master->dma_rx, bs->dma_sg_rx, nrx,
+					  DMA_DEV_TO_MEM,
+					  DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	desc_tx = dmaengine_prep_slave_sg(master->dma_tx, bs->dma_sg_tx, ntx,
+					  DMA_MEM_TO_DEV, DMA_CTRL_ACK);
+	if (!desc_rx || !desc_tx) {
+		dmaengine_terminate_all(master->dma_rx);
+		dmaengine_terminate_all(master->dma_tx);
+		return -ENOMEM;
 	}
+	desc_rx->callback = bcm2835_spi_dma_done;
+	desc_rx->callback_param = master;
+
+	dmaengine_submit(desc_rx);
+	dmaengine_submit(desc_tx);
+	bs->dma_chunk = bs->dma_offset;
+	bs->dma_nrx = tfr->rx_buf ? nrx : 0;
+	bs->dma_offset += len;
+	bs->dma_pending = true;
+
+	dma_async_issue_pending(master->dma_rx);
+	dma_async_issue_pending(master->dma_tx);
+
+	/* and kick the HW - TA stays set, so CS is held between chunks */
+	bcm2835_wr(bs, BCM2835_SPI_DLEN, len);
+	bcm2835_wr(bs, BCM2835_SPI_CS,
+		   bs->dma_cs | BCM2835_SPI_CS_TA | BCM2835_SPI_CS_DMAEN);
+
+	/* the CPU is free to checksum tx_buf while the chunk runs */
+	if (unlikely(bs->crc_ext) && tfr->tx_buf)
+		bs->crc_ext->crc_tx = bcm2835_spi_crc(bs->crc_ext->crc_type,
+						      bs->crc_ext->crc_tx,
+						      tfr->tx_buf + bs->dma_chunk,
+						      len);
+
+	return 0;
 }
 
-static irqreturn_t bcm2835_spi_interrupt(int irq, void *dev_id)
+/*
+ * hand the chunk just received to the CPU, for the CRC or a progress
+ * report - the lines straddling into the next chunk get invalidated
+ * again once that one is done
+ */
+static void bcm2835_spi_dma_sync_rx(struct spi_master *master)
 {
-	struct spi_master *master = dev_id;
 	struct bcm2835_spi *bs = spi_master_get_devdata(master);
-	u32 cs = bcm2835_rd(bs, BCM2835_SPI_CS);
-	debug_set_high3();
-
-	/* Read as many bytes of data as possible */
-	bcm2835_rd_fifo(bs);
-
-	/* Write as many bytes of data as possible */
-	bcm2835_wr_fifo(bs);
-
-	/* if length is empty, then disable interrupts */
-	if (! bs->len) {
-		/* Disable SPI interrupts */
-		cs &= ~(BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
-		bcm2835_wr(bs, BCM2835_SPI_CS, cs);
-
-		/*
-		 * Wake up bcm2835_spi_transfer_one(), which will call
-		 * bcm2835_spi_finish_transfer(), to drain the RX FIFO.
-		 */
-		complete(&bs->done);
-	}
+	struct device *dev = master->dma_rx->device->dev;
+	struct scatterlist *sg;
+	int i;
 
-	debug_set_low3();
-	return IRQ_HANDLED;
+	for_each_sg(bs->dma_sg_rx, sg, bs->dma_nrx, i)
+		dma_sync_single_for_cpu(dev, sg_dma_address(sg),
+					sg_dma_len(sg), DMA_FROM_DEVICE);
 }
 
-static int bcm2835_spi_start_transfer(struct spi_device *spi,
-		struct spi_transfer *tfr)
+/* checksum the chunk just received - synced by bcm2835_spi_dma_sync_rx */
+static void bcm2835_spi_dma_crc_rx(struct spi_master *master)
 {
-	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
-	unsigned long spi_hz, clk_hz, cdiv,xfer_time_us;
-	u32 cs = BCM2835_SPI_CS_TA;
-	unsigned long flags;
-
-	spi_hz = tfr->speed_hz;
-	clk_hz = clk_get_rate(bs->clk);
-
-	if (spi_hz >= clk_hz / 2) {
-		cdiv = 2; /* clk_hz/2 is the fastest we can go */
-	} else if (spi_hz) {
-		/* CDIV must be a power of two */
-		cdiv = DIV_ROUND_UP(clk_hz, spi_hz);
-		/* make the divider "even" by rounding up
-		 * this ensures that the phases are of equal length
-		 */
-		cdiv += (cdiv % 2) ;
-
-		if (cdiv >= 65536)
-			cdiv = 0; /* 0 is the slowest we can go */
-	} else
-		cdiv = 0; /* 0 is the slowest we can go */
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
 
-	if (spi->mode & SPI_CPOL)
-		cs |= BCM2835_SPI_CS_CPOL;
-	if (spi->mode & SPI_CPHA)
-		cs |= BCM2835_SPI_CS_CPHA;
+	bs->crc_ext->crc_rx = bcm2835_spi_crc(bs->crc_ext->crc_type,
+					      bs->crc_ext->crc_rx,
+					      bs->dma_tfr->rx_buf +
+					      bs->dma_chunk,
+					      bs->dma_offset - bs->dma_chunk);
+}
 
-	if (!(spi->mode & SPI_NO_CS)) {
-		cs |= spi->chip_select;
-	}
+static void bcm2835_spi_dma_done(void *data)
+{
+	struct spi_master *master = data;
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
 
-	spin_lock_irqsave(&bs->cspol_lock, flags);
-	cs |= bs->cspol;
-	spin_unlock_irqrestore(&bs->cspol_lock, flags);
+	bs->dma_pending = false;
 
-	/* LoSSI/9-bit mode */
-	if (spi->bits_per_word == 9)
-		cs |= BCM2835_SPI_CS_LEN;
+	if (bs->dma_nrx &&
+	    (unlikely(bs->crc_ext) || (bs->cur.ext && bs->cur.ext->progress)))
+		bcm2835_spi_dma_sync_rx(master);
+	if (unlikely(bs->crc_ext) && bs->dma_nrx)
+		bcm2835_spi_dma_crc_rx(master);
 
-	/* 3-WIRE mode */
-	if ( (spi->mode & SPI_3WIRE) && (tfr->rx_buf) )
-		cs |= BCM2835_SPI_CS_REN;
+	/* continue with the next chunk if there is one left */
+	if (bs->dma_offset < bs->dma_end) {
+		bs->xfer_err = bcm2835_spi_dma_chunk(master);
+		if (!bs->xfer_err)
+			return;
+	}
 
-	reinit_completion(&bs->done);
-	bs->tx_buf = tfr->tx_buf;
-	bs->rx_buf = tfr->rx_buf;
-	bs->len = tfr->len;
-	bs->bits_per_word = spi->bits_per_word;
-
-        bcm2835_wr(bs, BCM2835_SPI_CLK, cdiv);
-        /** Enable the HW block, but without the interrupts enabled,
-         * so that we can fill in some data into the fifo now
-         * and avoid delays doe to interrupt overheads...
-         */
-        bcm2835_wr(bs, BCM2835_SPI_CS, cs);
-        /* Write as many bytes of data as possible */
-        bcm2835_wr_fifo(bs);
-
-	/* calculate how long we have to wait aproximately */
-	xfer_time_us = cdiv
-		* 9 /* 8bit + 1 clock gap */
-		* tfr->len /* times the number of bytes to transfer */
-		* 1000000 /* get the measure in us */
-		/ clk_hz
-		;
-
-	/* if the time is bigger than the given BCM2835_SPI_POLLTIME_US
-	 * or we still have bytes to transfer
-	 * then run the interrupt
-	 * note that this still hides the fact that the interrupt+wakeup
-	 * is "expensive" and we should do all transfers in a message
-	 * without waking up the worker thread
-	 */
-	if ((bs->len) || (xfer_time_us > BCM2835_SPI_POLLTIME_US))  {
-		/* and now enable the interrupt for TX-empty*/
-		bcm2835_wr(bs, BCM2835_SPI_CS,
-			cs | BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
-	} else {
-		/* poll until we get there */
-		while (!(bcm2835_rd(bs, BCM2835_SPI_CS)
-				& BCM2835_SPI_CS_DONE)) ;
-		/* and set completed */
-		complete(&bs->done);
+	if (unlikely(bs->cur.ts_enabled))
+		bs->cur.ts_done = ktime_get();
+
+	/* finish the transfer in the same thread as for PIO transfers */
+	irq_wake_thread(bs->irq, master);
+}
+
+static int bcm2835_spi_start_dma(struct spi_master *master,
+		struct spi_transfer *tfr, unsigned int offset,
+		unsigned int len, u32 cs)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct scatterlist *sg_tx, *sg_rx;
+	unsigned int need = max3(tfr->tx_sg.nents, tfr->rx_sg.nents,
+				 (unsigned int)BCM2835_SPI_DMA_DUMMY_SG);
+
+	/* grow the scratch lists used to describe a chunk if needed */
+	if (need > bs->dma_sg_len) {
+		sg_tx = kcalloc(need, sizeof(*sg_tx), GFP_KERNEL);
+		sg_rx = kcalloc(need, sizeof(*sg_rx), GFP_KERNEL);
+		if (!sg_tx || !sg_rx) {
+			kfree(sg_tx);
+			kfree(sg_rx);
+			return -ENOMEM;
+		}
+		kfree(bs->dma_sg_tx);
+		kfree(bs->dma_sg_rx);
+		bs->dma_sg_tx = sg_tx;
+		bs->dma_sg_rx = sg_rx;
+		bs->dma_sg_len = need;
 	}
 
-	return 0;
+	bs->dma_tfr = tfr;
+	bs->dma_offset = offset;
+	bs->dma_end = offset + len;
+	bs->dma_cs = cs;
+	bs->tx_len = 0;
+	bs->rx_len = 0;
+	bs->fifo_long = false;
+
+	return bcm2835_spi_dma_chunk(master);
 }
 
-static int bcm2835_spi_finish_transfer(struct spi_device *spi,
-		struct spi_transfer *tfr, bool cs_change)
+static void bcm2835_spi_stop_dma(struct spi_master *master)
 {
-	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
-	u32 cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
 
-	/* Drain RX FIFO */
-	bcm2835_rd_fifo(bs);
+	if (!bs->dma_pending)
+		return;
 
-	if (tfr->delay_usecs) {
-		debug_set_high2();
-		udelay(tfr->delay_usecs);
-		debug_set_low2();
-	}
+	dmaengine_terminate_all(master->dma_tx);
+	dmaengine_terminate_all(master->dma_rx);
+	bs->dma_pending = false;
+}
+
+/* the divider for spi_hz - 0 for the slowest we can go */
+static int bcm2835_spi_calc_cdiv(struct spi_device *spi,
+		unsigned long clk_hz, unsigned long spi_hz, u32 *cdiv_out)
+{
+	unsigned long cdiv;
+	int err;
+
+	err = bcm2835_spi_select_cdiv(spi, clk_hz, spi_hz, &cdiv);
+	if (err)
+		return err;
 
-	if (cs_change)
-		/* Clear TA flag */
-		bcm2835_wr(bs, BCM2835_SPI_CS, cs & ~BCM2835_SPI_CS_TA);
+	*cdiv_out = (cdiv >= 65536) ? 0 : cdiv;
 
 	return 0;
 }
 
-static int bcm2835_spi_transfer_one(struct spi_master *master,
-		struct spi_message *mesg)
+/* (re)compute the cached divider for the default speed of the device */
+static int bcm2835_spi_update_state(struct spi_device *spi,
+		struct bcm2835_spi_state *state)
 {
-	struct bcm2835_spi *bs = spi_master_get_devdata(master);
-	struct spi_transfer *tfr;
-	struct spi_device *spi = mesg->spi;
-	int err = 0;
-	unsigned int timeout;
-	bool cs_change;
-	unsigned long flags;
-
-	debug_set_high();
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	u32 cdiv;
+	int err;
 
-	list_for_each_entry(tfr, &mesg->transfers, transfer_list) {
-		err = bcm2835_spi_start_transfer(spi, tfr);
-		if (err)
-			goto out;
+	err = bcm2835_spi_calc_cdiv(spi, bs->clk_hz, spi->max_speed_hz, &cdiv);
+	if (err)
+		return err;
 
-		debug_set_high2();
-		timeout = wait_for_completion_timeout(&bs->done,
-				msecs_to_jiffies(BCM2835_SPI_TIMEOUT_MS));
-		debug_set_low2();
+	state->cdiv = cdiv;
+	state->speed_hz = DIV_ROUND_UP(bs->clk_hz, cdiv ? cdiv : 65536);
+	state->clk_gen = bs->clk_gen;
 
-		if (!timeout) {
-			err = -ETIMEDOUT;
-			goto out;
-		}
+	return 0;
+}
 
-		cs_change = tfr->cs_change ||
-			list_is_last(&tfr->transfer_list, &mesg->transfers);
+static int bcm2835_spi_prepare_transfer(struct spi_device *spi,
+		struct spi_transfer *tfr, unsigned long clk_hz,
+		u32 *cs_out, u32 *cdiv_out)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct bcm2835_spi_state *state = spi->controller_state;
+	u32 cs;
+	int err;
 
-		err = bcm2835_spi_finish_transfer(spi, tfr, cs_change);
+	/* the core clock has changed since we computed the divider */
+	if (unlikely(state->clk_gen != bs->clk_gen)) {
+		err = bcm2835_spi_update_state(spi, state);
 		if (err)
-			goto out;
+			return err;
+	}
 
-		mesg->actual_length += (tfr->len - bs->len);
+	/* speed_hz is usually the one of the device - a speed reported
+	 * back earlier has been mapped to the one requested already, see
+	 * bcm2835_spi_requested_speed
+	 */
+	if (likely(tfr->speed_hz == state->speed_hz ||
+		   tfr->speed_hz == spi->max_speed_hz)) {
+		*cdiv_out = state->cdiv;
+	} else {
+		err = bcm2835_spi_calc_cdiv(spi, clk_hz, tfr->speed_hz,
+					    cdiv_out);
+		if (err)
+			return err;
 	}
 
-out:
-	/* Clear FIFOs, and disable the HW block */
-	spin_lock_irqsave(&bs->cspol_lock, flags);
-	bcm2835_wr(bs, BCM2835_SPI_CS,
-		BCM2835_SPI_CS_CLEAR_RX
-		| BCM2835_SPI_CS_CLEAR_TX
-		| bs->cspol );
-	spin_unlock_irqrestore(&bs->cspol_lock, flags);
+	/* the polarity of all chip-selects changes only on setup,
+	 * so no need for the lock when just reading it
+	 */
+	cs = state->cs | ACCESS_ONCE(bs->cspol);
 
-	mesg->status = err;
-	spi_finalize_current_message(master);
+	/* LoSSI/9-bit mode */
+	if (tfr->bits_per_word == 9)
+		cs |= BCM2835_SPI_CS_LEN;
+
+	/* 3-WIRE mode */
+	if ( (spi->mode & SPI_3WIRE) && (tfr->rx_buf) )
+		cs |= BCM2835_SPI_CS_REN;
+
+	*cs_out = cs;
 
-	debug_set_low();
 	return 0;
 }
 
+/* compute the CS register image and the divider of the device once */
 static int bcm2835_spi_setup(struct spi_device *spi)
 {
-	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
-	u32 mask = BCM2835_SPI_CS_CSPOL0 << spi->chip_select;
-	unsigned long flags;
+	struct bcm2835_spi_state *state = bcm2835_spi_get_state(spi);
+	u32 cs = 0;
 
-	spin_lock_irqsave(&bs->cspol_lock, flags);
+	if (IS_ERR(state))
+		return PTR_ERR(state);
 
-	/* clear the bit */
-	bs->cspol &= ~(mask);
+	bcm2835_spi_set_cspol(spi);
+
+	if (spi->mode & SPI_CPOL)
+		cs |= BCM2835_SPI_CS_CPOL;
+	if (spi->mode & SPI_CPHA)
+		cs |= BCM2835_SPI_CS_CPHA;
 
-	/* set cspol correctly */
 	if (!(spi->mode & SPI_NO_CS)) {
-		if (spi->mode & SPI_CS_HIGH)
-			/* set the bit */
-			bs->cspol |= mask;
+		cs |= spi->chip_select;
 	}
 
-	spin_unlock_irqrestore(&bs->cspol_lock, flags);
+	state->cs = cs;
 
-	return 0;
+	return bcm2835_spi_update_state(spi, state);
+}
+
+static void bcm2835_dma_release(struct spi_master *master)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	if (bs->dma_tx_dummy)
+		dma_free_coherent(master->dma_tx->device->dev, PAGE_SIZE,
+				  bs->dma_tx_dummy, bs->dma_tx_dummy_addr);
+	if (bs->dma_rx_dummy)
+		dma_free_coherent(master->dma_rx->device->dev, PAGE_SIZE,
+				  bs->dma_rx_dummy, bs->dma_rx_dummy_addr);
+	bs->dma_tx_dummy = NULL;
+	bs->dma_rx_dummy = NULL;
+
+	if (master->dma_tx) {
+		dmaengine_terminate_all(master->dma_tx);
+		dma_release_channel(master->dma_tx);
+		master->dma_tx = NULL;
+	}
+	if (master->dma_rx) {
+		dmaengine_terminate_all(master->dma_rx);
+		dma_release_channel(master->dma_rx);
+		master->dma_rx = NULL;
+	}
+
+	kfree(bs->dma_sg_tx);
+	kfree(bs->dma_sg_rx);
+	bs->dma_sg_tx = NULL;
+	bs->dma_sg_rx = NULL;
+	bs->dma_sg_len = 0;
+	bs->dma_enabled = false;
+}
+
+static void bcm2835_dma_init(struct spi_master *master, struct device *dev)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct dma_slave_config slave_config;
+	const __be32 *addr;
+	dma_addr_t dma_reg_base;
+	int ret;
+
+	/* base address in dma-space */
+	addr = of_get_address(master->dev.of_node, 0, NULL, NULL);
+	if (!addr) {
+		dev_err(dev, "could not get DMA-register address - not using dma mode\n");
+		return;
+	}
+	dma_reg_base = be32_to_cpup(addr);
+
+	/* get tx/rx dma */
+	master->dma_tx = dma_request_slave_channel(dev, "tx");
+	if (!master->dma_tx) {
+		dev_err(dev, "no tx-dma configuration found - not using dma mode\n");
+		goto err;
+	}
+	master->dma_rx = dma_request_slave_channel(dev, "rx");
+	if (!master->dma_rx) {
+		dev_err(dev, "no rx-dma configuration found - not using dma mode\n");
+		goto err;
+	}
+
+	/* configure DMAs */
+	memset(&slave_config, 0, sizeof(slave_config));
+	slave_config.direction = DMA_MEM_TO_DEV;
+	slave_config.dst_addr = (u32)(dma_reg_base + BCM2835_SPI_FIFO);
+	slave_config.dst_addr_width = DMA_SLAVE_BUSWIDTH_4_BYTES;
+	ret = dmaengine_slave_config(master->dma_tx, &slave_config);
+	if (ret)
+		goto err_config;
+
+	memset(&slave_config, 0, sizeof(slave_config));
+	slave_config.direction = DMA_DEV_TO_MEM;
+	slave_config.src_addr = (u32)(dma_reg_base + BCM2835_SPI_FIFO);
+	slave_config.src_addr_width = DMA_SLAVE_BUSWIDTH_4_BYTES;
+	ret = dmaengine_slave_config(master->dma_rx, &slave_config);
+	if (ret)
+		goto err_config;
+
+	/* the pages we use for transfers with tx_buf or rx_buf == NULL */
+	bs->dma_tx_dummy = dma_zalloc_coherent(master->dma_tx->device->dev,
+					       PAGE_SIZE,
+					       &bs->dma_tx_dummy_addr,
+					       GFP_KERNEL);
+	bs->dma_rx_dummy = dma_alloc_coherent(master->dma_rx->device->dev,
+					      PAGE_SIZE,
+					      &bs->dma_rx_dummy_addr,
+					      GFP_KERNEL);
+	if (!bs->dma_tx_dummy || !bs->dma_rx_dummy) {
+		dev_err(dev, "could not allocate dma dummy pages - not using dma mode\n");
+		goto err;
+	}
+
+	/* all went well, so set can_dma */
+	master->can_dma = bcm2835_spi_can_dma;
+	bs->dma_enabled = true;
+
+	return;
+
+err_config:
+	dev_err(dev, "issue configuring dma: %d - not using DMA mode\n",
+		ret);
+err:
+	bcm2835_dma_release(master);
 }
 
 static int bcm2835_spi_probe(struct platform_device *pdev)
@@ -371,6 +546,9 @@ static int bcm2835_spi_probe(struct platform_device *pdev)
 	struct resource *res;
 	int err;
 
+	debug_init_pin();
+	debug_init_pin2();
+	debug_init_pin3();
 	debug_set_low();
 	debug_set_low2();
 	debug_set_low3();
@@ -384,17 +562,17 @@ static int bcm2835_spi_probe(struct platform_device *pdev)
 	platform_set_drvdata(pdev, master);
 
 	master->mode_bits = BCM2835_SPI_MODE_BITS;
-	master->bits_per_word_mask = SPI_BPW_RANGE_MASK(8,9);
+	master->bits_per_word_mask = SPI_BPW_RANGE_MASK(8, 9) |
+		SPI_BPW_MASK(16) | SPI_BPW_MASK(32);
 	master->num_chipselect = 3;
 	master->transfer_one_message = bcm2835_spi_transfer_one;
 	master->setup = bcm2835_spi_setup;
+	master->cleanup = bcm2835_spi_cleanup;
 	master->dev.of_node = pdev->dev.of_node;
 	master->rt = 1;
 
 	bs = spi_master_get_devdata(master);
 
-	init_completion(&bs->done);
-
 	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
 	bs->regs = devm_ioremap_resource(&pdev->dev, res);
 	if (IS_ERR(bs->regs)) {
@@ -416,33 +594,51 @@ static int bcm2835_spi_probe(struct platform_device *pdev)
 		goto out_master_put;
 	}
 
-	spin_lock_init(&bs->cspol_lock);
-	bs->cspol=0;
+	bcm2835_spi_core_init(bs);
 
 	clk_prepare_enable(bs->clk);
+	bcm2835_spi_clk_init(bs, &pdev->dev);
 
-	err = devm_request_irq(&pdev->dev, bs->irq, bcm2835_spi_interrupt, 0,
-				dev_name(&pdev->dev), master);
+	/* the FIFO gets serviced in hard interrupt context even on RT,
+	 * only finishing a transfer and starting the next runs threaded
+	 */
+	err = devm_request_threaded_irq(&pdev->dev, bs->irq,
+					bcm2835_spi_interrupt,
+					bcm2835_spi_irq_thread,
+					IRQF_NO_THREAD,
+					dev_name(&pdev->dev), master);
 	if (err) {
 		dev_err(&pdev->dev, "could not request IRQ: %d\n", err);
 		goto out_clk_disable;
 	}
 
+	bcm2835_dma_init(master, &pdev->dev);
+
+	bcm2835_spi_calibrate(master);
+
 	/* initialise the hardware */
 	bcm2835_wr(bs, BCM2835_SPI_CS,
 		bs->cspol
 		| BCM2835_SPI_CS_CLEAR_RX
 		| BCM2835_SPI_CS_CLEAR_TX);
 
-	err = devm_spi_register_master(&pdev->dev, master);
+	bcm2835_spi_pm_init(master, &pdev->dev);
+
+	err = spi_register_master(master);
 	if (err) {
 		dev_err(&pdev->dev, "could not register SPI master: %d\n", err);
-		goto out_clk_disable;
+		goto out_pm_release;
 	}
 
+	bcm2835_debugfs_create(bs, dev_name(&pdev->dev));
+
 	return 0;
 
+out_pm_release:
+	bcm2835_spi_pm_release(&pdev->dev);
+	bcm2835_dma_release(master);
 out_clk_disable:
+	bcm2835_spi_clk_release(bs);
 	clk_disable_unprepare(bs->clk);
 out_master_put:
 	spi_master_put(master);
@@ -451,15 +647,30 @@ out_master_put:
 
 static int bcm2835_spi_remove(struct platform_device *pdev)
 {
-	struct spi_master *master = platform_get_drvdata(pdev);
+	struct spi_master *master = spi_master_get(platform_get_drvdata(pdev));
 	struct bcm2835_spi *bs = spi_master_get_devdata(master);
 
+	/* stops the message queue once the running message is done, before
+	 * the DMA channels and runtime PM go away underneath it
+	 */
+	spi_unregister_master(master);
+
+	bcm2835_debugfs_remove(bs);
+
+	/* the clock has to run to reset the HW */
+	bcm2835_spi_pm_release(&pdev->dev);
+
 	/* Clear FIFOs, and disable the HW block */
 	bcm2835_wr(bs, BCM2835_SPI_CS,
 		   BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX);
 
+	bcm2835_spi_clk_release(bs);
 	clk_disable_unprepare(bs->clk);
 
+	bcm2835_dma_release(master);
+
+	spi_master_put(master);
+
 	return 0;
 }
 
@@ -475,6 +686,7 @@ static struct platform_driver bcm2835_spi_driver = {
 		.name		= DRV_NAME,
 		.owner		= THIS_MODULE,
 		.of_match_table	= bcm2835_spi_match,
+		.pm		= &bcm2835_spi_pm_ops,
 	},
 	.probe		= bcm2835_spi_probe,
 	.remove		= bcm2835_spi_remove,